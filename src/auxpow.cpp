@@ -112,7 +112,7 @@ CScript MakeCoinbaseWithAux(unsigned int nBits, unsigned int nExtraNonce, vector
 }
 
 
-void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, vector<unsigned char>& vchAux)
+void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, vector<unsigned char>& vchAux, const vector<uint256>* pvCoinbaseBranch)
 {
     // Update nExtraNonce
     int64 nNow = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
@@ -122,8 +122,7 @@ void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigne
         nPrevTime = nNow;
     }
 
-    pblock->vtx[0].vin[0].scriptSig = MakeCoinbaseWithAux(pblock->nBits, nExtraNonce, vchAux);
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    SetCoinbaseScript(pblock, MakeCoinbaseWithAux(pblock->nBits, nExtraNonce, vchAux), pvCoinbaseBranch);
 }
 
 
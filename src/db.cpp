@@ -329,57 +329,63 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+bool CTxDB::ReadBlockIndex(uint256 hash, CDiskBlockIndex& blockindex)
+{
+    return Read(make_pair(string("blockindex"), hash), blockindex);
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
+    // An aux work entry without its auxpow can't be serialized
+    if ((blockindex.nVersion & BLOCK_VERSION_AUXPOW) && !blockindex.auxpow)
+        return error("CTxDB::WriteBlockIndex() : auxpow missing for block %d", blockindex.nHeight);
+
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
 bool CTxDB::EraseBlockIndex(uint256 hash)
 {
+    // Snapshots can't express removed entries, stop using the current one
+    Erase(string("indexsnapshot"));
     return Erase(make_pair(string("blockindex"), hash));
 }
 
-bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
+bool CTxDB::ReadBlockIndexSnapshotStamp(uint64& nStamp)
 {
-    return Read(string("hashBestChain"), hashBestChain);
+    return Read(string("indexsnapshot"), nStamp);
 }
 
-bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
+bool CTxDB::WriteBlockIndexSnapshotStamp(uint64 nStamp)
 {
-    return Write(string("hashBestChain"), hashBestChain);
+    return Write(string("indexsnapshot"), nStamp);
 }
 
-bool CTxDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
+bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
-    return Read(string("bnBestInvalidWork"), bnBestInvalidWork);
+    return Read(string("hashBestChain"), hashBestChain);
 }
 
-bool CTxDB::WriteBestInvalidWork(CBigNum bnBestInvalidWork)
+bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
 {
-    return Write(string("bnBestInvalidWork"), bnBestInvalidWork);
+    return Write(string("hashBestChain"), hashBestChain);
 }
 
-CBlockIndex static * InsertBlockIndex(uint256 hash)
+bool CTxDB::ReadBestInvalidWork(uint256& nBestInvalidWork)
 {
-    if (hash == 0)
-        return NULL;
-
-    // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
-
-    // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    // Kept as a CBigNum on disk so existing databases still load
+    CBigNum bnBestInvalidWork;
+    if (!Read(string("bnBestInvalidWork"), bnBestInvalidWork))
+        return false;
+    nBestInvalidWork = bnBestInvalidWork.getuint256();
+    return true;
+}
 
-    return pindexNew;
+bool CTxDB::WriteBestInvalidWork(uint256 nBestInvalidWork)
+{
+    return Write(string("bnBestInvalidWork"), CBigNum(nBestInvalidWork));
 }
 
-bool CTxDB::LoadBlockIndex()
+bool CTxDB::LoadBlockIndexRecords()
 {
     // Get database cursor
     Dbc* pcursor = GetCursor();
@@ -422,13 +428,13 @@ bool CTxDB::LoadBlockIndex()
             pindexNew->nTime          = diskindex.nTime;
             pindexNew->nBits          = diskindex.nBits;
             pindexNew->nNonce         = diskindex.nNonce;
-            pindexNew->auxpow         = diskindex.auxpow;
+            AddBlockIndexPos(pindexNew);
 
             // Watch for genesis block
             if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
                 pindexGenesisBlock = pindexNew;
 
-            if (!pindexNew->CheckIndex())
+            if (!diskindex.CheckIndex())
                 return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
         }
         else
@@ -438,7 +444,7 @@ bool CTxDB::LoadBlockIndex()
     }
     pcursor->close();
 
-    // Calculate bnChainWork
+    // Calculate nChainWork
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -450,9 +456,20 @@ bool CTxDB::LoadBlockIndex()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + pindex->GetBlockWork();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork();
+        pindex->BuildSkip();
     }
 
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    // The snapshot written at the last shutdown is much faster to load than
+    // the blockindex records, if it still matches them
+    if (!LoadBlockIndexSnapshot(*this) && !LoadBlockIndexRecords())
+        return false;
+
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -464,11 +481,12 @@ bool CTxDB::LoadBlockIndex()
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexBest->bnChainWork;
+    SetActiveChainTip(pindexBest);
+    nBestChainWork = pindexBest->nChainWork;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight);
 
-    // Load bnBestInvalidWork, OK if it doesn't exist
-    ReadBestInvalidWork(bnBestInvalidWork);
+    // Load nBestInvalidWork, OK if it doesn't exist
+    ReadBestInvalidWork(nBestInvalidWork);
 
     // Verify blocks in the best chain
     CBlockIndex* pindexFork = NULL;
@@ -283,13 +283,18 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadBlockIndex(uint256 hash, CDiskBlockIndex& blockindex);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool EraseBlockIndex(uint256 hash);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
-    bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
-    bool WriteBestInvalidWork(CBigNum bnBestInvalidWork);
+    bool ReadBestInvalidWork(uint256& nBestInvalidWork);
+    bool WriteBestInvalidWork(uint256 nBestInvalidWork);
+    bool ReadBlockIndexSnapshotStamp(uint64& nStamp);
+    bool WriteBlockIndexSnapshotStamp(uint64 nStamp);
     bool LoadBlockIndex();
+private:
+    bool LoadBlockIndexRecords();
 };
 
 
@@ -57,6 +57,8 @@
 #include <map>
 
 #include <boost/foreach.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/shared_ptr.hpp>
 
 #ifdef __WXMSW__
 #include <windows.h>
@@ -71,7 +73,9 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -84,6 +88,10 @@
 #ifdef BSD
 #include <netinet/in.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 
 #pragma hdrstop
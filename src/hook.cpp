@@ -26,6 +26,7 @@ public:
             CBlockIndex* pindexBlock);
     virtual bool ConnectBlock(CBlock& block, CTxDB& txdb, CBlockIndex* pindex);
     virtual bool DisconnectBlock(CBlock& block, CTxDB& txdb, CBlockIndex* pindex);
+    virtual void AbortBlockTxn();
     virtual bool ExtractAddress(const CScript& script, string& address);
     virtual bool GenesisBlock(CBlock& block)
     {
@@ -135,6 +136,10 @@ bool CStandardHooks::DisconnectBlock(CBlock& block, CTxDB& txdb, CBlockIndex* pi
     return true;
 }
 
+void CStandardHooks::AbortBlockTxn()
+{
+}
+
 bool CStandardHooks::ExtractAddress(const CScript& script, string& address) {
     return false;
 }
@@ -22,6 +22,8 @@ public:
             CBlockIndex* pindexBlock) = 0;
     virtual bool ConnectBlock(CBlock& block, CTxDB& txdb, CBlockIndex* pindex) = 0;
     virtual bool DisconnectBlock(CBlock& block, CTxDB& txdb, CBlockIndex* pindex) = 0;
+    // Called when the txdb transaction of a block connect/reorganize is aborted
+    virtual void AbortBlockTxn() = 0;
     virtual bool ExtractAddress(const CScript& script, std::string& address) = 0;
     virtual bool GenesisBlock(CBlock& block) = 0;
     virtual bool Lockin(int nHeight, uint256 hash) = 0;
@@ -14,7 +14,9 @@
 using namespace std;
 using namespace boost;
 
-void rescanfornames();
+bool rescanfornames();
+bool NameIndexRebuildPending();
+void CheckNameSecondaryIndexes();
 
 CWallet* pwalletMain;
 
@@ -48,6 +50,8 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         DBFlush(false);
         StopNode();
+        StopSignatureCheckThreads();
+        WriteBlockIndexSnapshot();
         DBFlush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -202,6 +206,14 @@ bool AppInit2(int argc, char* argv[])
             "  -rpcallowip=<ip> \t\t  " + _("Allow JSON-RPC connections from specified IP address\n") +
             "  -rpcconnect=<ip> \t  "   + _("Send commands to node running on <ip> (default: 127.0.0.1)\n") +
             "  -keypool=<n>     \t  "   + _("Set key pool size to <n> (default: 100)\n") +
+            "  -par=<n>         \t  "   + _("Number of signature verification threads (default: 0 = one per core)\n") +
+            "  -maxorphanblocks=<n>\t  "+ _("Keep at most <n> MB of blocks whose parent is missing (default: 40)\n") +
+            "  -maxorphantx=<n> \t  "   + _("Keep at most <n> KB of transactions whose inputs are missing (default: 5000)\n") +
+            "  -maxsigcachesize=<n>\t  "+ _("Number of verified signatures to remember (default: 50000)\n") +
+            "  -messagethreads=<n>\t  " + _("Number of threads handling peer messages (default: 2)\n") +
+            "  -benchmark       \t  "   + _("Log per block validation statistics and enable the bench* RPC calls\n") +
+            "  -namecachesize=<n>\t  "  + _("Number of names to keep in the name index cache (default: 50000)\n") +
+            "  -namevalueindex  \t  "   + _("Maintain an index of names by value hash\n") +
             "  -rescan          \t  "   + _("Rescan the block chain for missing wallet transactions\n");
 
 #ifdef USE_SSL
@@ -228,6 +240,7 @@ bool AppInit2(int argc, char* argv[])
     }
 
     fDebug = GetBoolArg("-debug");
+    fBenchmark = GetBoolArg("-benchmark");
     fAllowDNS = GetBoolArg("-dns");
 
 #ifndef __WXMSW__
@@ -382,6 +395,11 @@ bool AppInit2(int argc, char* argv[])
         strErrors += _("Error loading addr.dat      \n");
     printf(" addresses   %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    StartSignatureCheckThreads(GetArg("-par", 0));
+    SetSignatureCacheSize(max((int64)0, GetArg("-maxsigcachesize", 50000)));
+    SetOrphanPoolLimits(max((int64)1, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS_SIZE / 1000000)) * 1000000,
+                        max((int64)1, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TX_SIZE / 1000)) * 1000);
+
     printf("Loading block index...\n");
     nStart = GetTimeMillis();
     if (!LoadBlockIndex())
@@ -456,7 +474,7 @@ bool AppInit2(int argc, char* argv[])
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -549,12 +567,17 @@ bool AppInit2(int argc, char* argv[])
     RandAddSeedPerfmon();
 
     filesystem::path nameindexfile = filesystem::path(GetDataDir()) / "nameindexfull.dat";
-    if (!filesystem::exists(nameindexfile))
+    if (!filesystem::exists(nameindexfile) || NameIndexRebuildPending())
     {   
         //PrintConsole("Scanning blockchain for names to create fast index...");
-        rescanfornames();
+        if (!rescanfornames())
+        {
+            wxMessageBox(_("Error building the name index, restart to resume"), "Bitcoin", wxOK | wxICON_ERROR);
+            return false;
+        }
         //PrintConsole("\n");
     }
+    CheckNameSecondaryIndexes();
 
     if (!CreateThread(StartNode, NULL))
         wxMessageBox("Error: CreateThread(StartNode) failed", "Bitcoin");
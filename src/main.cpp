@@ -30,24 +30,27 @@ CCriticalSection cs_mapTransactions;
 unsigned int nTransactionsUpdated = 0;
 map<COutPoint, CInPoint> mapNextTx;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+static boost::unordered_map<uint64, CBlockIndex*> mapBlockIndexByPos;
+static CCriticalSection cs_mapBlockIndexByPos;
 uint256 hashGenesisBlock("0x000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
-CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
+uint256 nProofOfWorkLimit(~uint256(0) >> 32);
 const int nTotalBlocksEstimate = 134444; // Conservative estimate of total nr of blocks on main chain
 const int nInitialBlockThreshold = 120; // Regard blocks up until N-threshold as "initial download"
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
-CBigNum bnBestChainWork = 0;
-CBigNum bnBestInvalidWork = 0;
+uint256 nBestChainWork = 0;
+uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+vector<CBlockIndex*> vActiveChain;
+static const int64 BLOCK_INDEX_SNAPSHOT_INTERVAL = 60 * 60;
+static int64 nLastBlockIndexSnapshot = 0;
 int64 nTimeBestReceived = 0;
+int nSignatureCheckThreads = 0;
 
-map<uint256, CBlock*> mapOrphanBlocks;
-multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
-
-map<uint256, CDataStream*> mapOrphanTransactions;
-multimap<uint256, CDataStream*> mapOrphanTransactionsByPrev;
+COrphanPool<CBlock> poolOrphanBlocks(DEFAULT_MAX_ORPHAN_BLOCKS_SIZE, DEFAULT_MAX_ORPHAN_BLOCKS_SIZE / 4);
+COrphanPool<CDataStream> poolOrphanTransactions(DEFAULT_MAX_ORPHAN_TX_SIZE, DEFAULT_MAX_ORPHAN_TX_SIZE / 4);
 
 
 double dHashesPerSec;
@@ -70,6 +73,15 @@ int fUseUPnP = false;
 
 CHooks* hooks;
 
+static boost::thread_specific_ptr<CHashCounters> ptrHashCounters;
+
+CHashCounters& GetHashCounters()
+{
+    if (!ptrHashCounters.get())
+        ptrHashCounters.reset(new CHashCounters());
+    return *ptrHashCounters;
+}
+
 
 
 
@@ -163,38 +175,36 @@ void static ResendWalletTransactions()
 // mapOrphanTransactions
 //
 
-void static AddOrphanTx(const CDataStream& vMsg)
+void static AddOrphanTx(const CDataStream& vMsg, unsigned int nPeer)
 {
     CTransaction tx;
     CDataStream(vMsg) >> tx;
     uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
+    if (poolOrphanTransactions.count(hash))
         return;
-    CDataStream* pvMsg = mapOrphanTransactions[hash] = new CDataStream(vMsg);
+    vector<uint256> vPrev;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev.insert(make_pair(txin.prevout.hash, pvMsg));
+        vPrev.push_back(txin.prevout.hash);
+    if (!poolOrphanTransactions.Add(hash, new CDataStream(vMsg), vPrev, vMsg.size(), nPeer))
+        printf("orphan tx %s too large for the orphan pool\n", hash.ToString().substr(0,10).c_str());
 }
 
-void static EraseOrphanTx(uint256 hash)
+void SetOrphanPoolLimits(uint64 nMaxBlocksSize, uint64 nMaxTxSize)
 {
-    if (!mapOrphanTransactions.count(hash))
-        return;
-    const CDataStream* pvMsg = mapOrphanTransactions[hash];
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    CRITICAL_BLOCK(cs_main)
     {
-        for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(txin.prevout.hash);
-             mi != mapOrphanTransactionsByPrev.upper_bound(txin.prevout.hash);)
-        {
-            if ((*mi).second == pvMsg)
-                mapOrphanTransactionsByPrev.erase(mi++);
-            else
-                mi++;
-        }
+        poolOrphanBlocks.SetLimits(nMaxBlocksSize, nMaxBlocksSize / 4);
+        poolOrphanTransactions.SetLimits(nMaxTxSize, nMaxTxSize / 4);
+    }
+}
+
+void GetOrphanPoolStats(COrphanPoolStats& blocks, COrphanPoolStats& transactions)
+{
+    CRITICAL_BLOCK(cs_main)
+    {
+        poolOrphanBlocks.GetStats(blocks);
+        poolOrphanTransactions.GetStats(transactions);
     }
-    delete pvMsg;
-    mapOrphanTransactions.erase(hash);
 }
 
 
@@ -278,14 +288,19 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
-    if (!pindex || !pindex->IsInMainChain())
-        return 0;
+    // Callers holding cs_mapWallet must have taken cs_main first.
+    CRITICAL_BLOCK(cs_main)
+    {
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end())
+            return 0;
+        CBlockIndex* pindex = (*mi).second;
+        if (!pindex || !pindex->IsInMainChain())
+            return 0;
 
-    return pindexBest->nHeight - pindex->nHeight + 1;
+        return pindexBest->nHeight - pindex->nHeight + 1;
+    }
+    return 0;
 }
 
 
@@ -508,23 +523,28 @@ int CMerkleTx::GetDepthInMainChain(int& nHeightRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
-    if (!pindex || !pindex->IsInMainChain())
-        return 0;
-
-    // Make sure the merkle branch connects to this block
-    if (!fMerkleVerified)
+    // Callers holding cs_mapWallet must have taken cs_main first.
+    CRITICAL_BLOCK(cs_main)
     {
-        if (CBlock::CheckMerkleBranch(GetHash(), vMerkleBranch, nIndex) != pindex->hashMerkleRoot)
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end())
+            return 0;
+        CBlockIndex* pindex = (*mi).second;
+        if (!pindex || !pindex->IsInMainChain())
             return 0;
-        fMerkleVerified = true;
-    }
 
-    nHeightRet = pindex->nHeight;
-    return pindexBest->nHeight - pindex->nHeight + 1;
+        // Make sure the merkle branch connects to this block
+        if (!fMerkleVerified)
+        {
+            if (CBlock::CheckMerkleBranch(GetHash(), vMerkleBranch, nIndex) != pindex->hashMerkleRoot)
+                return 0;
+            fMerkleVerified = true;
+        }
+
+        nHeightRet = pindex->nHeight;
+        return pindexBest->nHeight - pindex->nHeight + 1;
+    }
+    return 0;
 }
 
 
@@ -585,15 +605,8 @@ bool CWalletTx::AcceptWalletTransaction()
 
 int CTxIndex::GetDepthInMainChain() const
 {
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
-        return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
+    CBlockIndex* pindex = GetBlockIndexAtPos(pos.nFile, pos.nBlockPos);
     if (!pindex || !pindex->IsInMainChain())
         return 0;
     return 1 + nBestHeight - pindex->nHeight;
@@ -639,8 +652,9 @@ void CBlock::SetAuxPow(CAuxPow* pow)
 uint256 static GetOrphanRoot(const CBlock* pblock)
 {
     // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblock->hashPrevBlock))
-        pblock = mapOrphanBlocks[pblock->hashPrevBlock];
+    const CBlock* pblockPrev;
+    while ((pblockPrev = poolOrphanBlocks.Get(pblock->hashPrevBlock)) != NULL)
+        pblock = pblockPrev;
     return pblock->GetHash();
 }
 
@@ -662,7 +676,7 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast)
 
     // Genesis block
     if (pindexLast == NULL)
-        return bnProofOfWorkLimit.GetCompact();
+        return nProofOfWorkLimit.GetCompact();
 
     // Only change once per interval
     if ((pindexLast->nHeight+1) % nInterval != 0)
@@ -688,35 +702,37 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast)
     if (nActualTimespan > nTargetTimespan*4)
         nActualTimespan = nTargetTimespan*4;
 
-    // Retarget
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexLast->nBits);
-    bnNew *= nActualTimespan;
-    bnNew /= nTargetTimespan;
+    // Retarget, nActualTimespan is bounded above so the product fits
+    uint256 nNew;
+    nNew.SetCompact(pindexLast->nBits);
+    nNew *= (unsigned int)nActualTimespan;
+    nNew /= uint256(nTargetTimespan);
 
-    if (bnNew > bnProofOfWorkLimit)
-        bnNew = bnProofOfWorkLimit;
+    if (nNew > nProofOfWorkLimit)
+        nNew = nProofOfWorkLimit;
 
     /// debug print
     printf("GetNextWorkRequired RETARGET\n");
     printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nTargetTimespan, nActualTimespan);
-    printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    printf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
+    printf("After:  %08x  %s\n", nNew.GetCompact(), nNew.ToString().c_str());
 
-    return bnNew.GetCompact();
+    return nNew.GetCompact();
 }
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative;
+    bool fOverflow;
+    uint256 nTarget;
+    nTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || fOverflow || nTarget == 0 || nTarget > nProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > nTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -745,15 +761,15 @@ bool IsInitialBlockDownload()
 
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
-    if (pindexNew->bnChainWork > bnBestInvalidWork)
+    if (pindexNew->nChainWork > nBestInvalidWork)
     {
-        bnBestInvalidWork = pindexNew->bnChainWork;
-        CTxDB().WriteBestInvalidWork(bnBestInvalidWork);
+        nBestInvalidWork = pindexNew->nChainWork;
+        CTxDB().WriteBestInvalidWork(nBestInvalidWork);
         MainFrameRepaint();
     }
-    printf("InvalidChainFound: invalid block=%s  height=%d  work=%s\n", pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight, pindexNew->bnChainWork.ToString().c_str());
-    printf("InvalidChainFound:  current best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
-    if (pindexBest && bnBestInvalidWork > bnBestChainWork + pindexBest->GetBlockWork() * 6)
+    printf("InvalidChainFound: invalid block=%s  height=%d  work=%s\n", pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight, pindexNew->nChainWork.ToString().c_str());
+    printf("InvalidChainFound:  current best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, nBestChainWork.ToString().c_str());
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
         printf("InvalidChainFound: WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.\n");
 }
 
@@ -804,8 +820,129 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb, CBlockIndex* pindex)
 }
 
 
+//
+// Signature check threads.  A batch of checks is split into chunks which the
+// threads and the caller take in turn, so the caller never waits for a thread
+// that has not started working yet.
+//
+
+static const unsigned int SIGNATURE_CHECK_CHUNK = 16;
+static const int MAX_SIGNATURE_CHECK_THREADS = 16;
+
+static boost::mutex mutexSignatureCheckBatch;
+static boost::mutex mutexSignatureChecks;
+static boost::condition_variable condSignatureChecks;
+static boost::condition_variable condSignatureChecksDone;
+static const vector<CSignatureCheck>* pvSignatureChecks = NULL;
+static unsigned int nSignatureCheckNext = 0;
+static int nSignatureCheckActive = 0;
+static int nSignatureCheckThreadsRunning = 0;
+static bool fSignatureChecksFailed = false;
+static bool fSignatureCheckStop = false;
+
+// Verify the next chunk of the current batch, returns false if there is none.
+// Must be called with mutexSignatureChecks held by lock.
+static bool VerifySignatureCheckChunk(boost::unique_lock<boost::mutex>& lock)
+{
+    if (!pvSignatureChecks || fSignatureChecksFailed || nSignatureCheckNext >= pvSignatureChecks->size())
+        return false;
+    const vector<CSignatureCheck>& vChecks = *pvSignatureChecks;
+    unsigned int nBegin = nSignatureCheckNext;
+    unsigned int nEnd = min((unsigned int)vChecks.size(), nBegin + SIGNATURE_CHECK_CHUNK);
+    nSignatureCheckNext = nEnd;
+    nSignatureCheckActive++;
+
+    lock.unlock();
+    bool fValid = true;
+    for (unsigned int i = nBegin; i < nEnd && fValid; i++)
+        fValid = vChecks[i].Verify();
+    lock.lock();
+
+    if (!fValid)
+        fSignatureChecksFailed = true;
+    if (--nSignatureCheckActive == 0)
+        condSignatureChecksDone.notify_all();
+    return true;
+}
+
+void ThreadSignatureCheck(void* parg)
+{
+    boost::unique_lock<boost::mutex> lock(mutexSignatureChecks);
+    while (!fSignatureCheckStop)
+        if (!VerifySignatureCheckChunk(lock))
+            condSignatureChecks.wait(lock);
+
+    // Counted by StartSignatureCheckThreads before the thread was created
+    if (--nSignatureCheckThreadsRunning == 0)
+        condSignatureChecksDone.notify_all();
+}
+
+void StartSignatureCheckThreads(int nThreads)
+{
+    // nThreads counts the calling thread, 0 means one per core
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = max(1, min(nThreads, MAX_SIGNATURE_CHECK_THREADS));
+
+    for (int i = 1; i < nThreads; i++)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutexSignatureChecks);
+            nSignatureCheckThreadsRunning++;
+        }
+        if (!CreateThread(ThreadSignatureCheck, NULL))
+        {
+            boost::lock_guard<boost::mutex> lock(mutexSignatureChecks);
+            nSignatureCheckThreadsRunning--;
+            break;
+        }
+        nSignatureCheckThreads++;
+    }
+    printf("Using %d threads for signature verification\n", nSignatureCheckThreads + 1);
+}
+
+// The threads wait on static condition variables, they have to be gone
+// before exit() destroys them
+void StopSignatureCheckThreads()
+{
+    boost::unique_lock<boost::mutex> lock(mutexSignatureChecks);
+    fSignatureCheckStop = true;
+    condSignatureChecks.notify_all();
+    while (nSignatureCheckThreadsRunning > 0)
+        condSignatureChecksDone.wait(lock);
+    nSignatureCheckThreads = 0;
+}
+
+bool VerifySignatureChecks(const vector<CSignatureCheck>& vChecks)
+{
+    if (nSignatureCheckThreads == 0 || vChecks.size() <= SIGNATURE_CHECK_CHUNK)
+    {
+        BOOST_FOREACH(const CSignatureCheck& check, vChecks)
+            if (!check.Verify())
+                return false;
+        return true;
+    }
+
+    // One batch at a time, the caller helps until the last chunk is taken
+    // and then waits for the chunks still being verified by the threads
+    boost::lock_guard<boost::mutex> lockBatch(mutexSignatureCheckBatch);
+    boost::unique_lock<boost::mutex> lock(mutexSignatureChecks);
+    pvSignatureChecks = &vChecks;
+    nSignatureCheckNext = 0;
+    fSignatureChecksFailed = false;
+    condSignatureChecks.notify_all();
+
+    while (VerifySignatureCheckChunk(lock))
+        ;
+    while (nSignatureCheckActive > 0)
+        condSignatureChecksDone.wait(lock);
+    pvSignatureChecks = NULL;
+    return !fSignatureChecksFailed;
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx,
-                                 CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee)
+                                 CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee,
+                                 map<uint256, CTransaction>* pmapTxPrev, vector<CSignatureCheck>* pvChecks)
 {
     // Take over previous transactions' spent pointers
     if (!IsCoinBase())
@@ -848,6 +985,11 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
                 if (!fFound)
                     txindex.vSpent.resize(txPrev.vout.size());
             }
+            else if (pmapTxPrev && pmapTxPrev->count(prevout.hash))
+            {
+                // Get prev tx from the caller's cache
+                txPrev = (*pmapTxPrev)[prevout.hash];
+            }
             else
             {
                 // Get prev tx from disk
@@ -860,12 +1002,20 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
 
             // If prev is coinbase, check that it's matured
             if (txPrev.IsCoinBase())
-                for (CBlockIndex* pindex = pindexBlock; pindex && pindexBlock->nHeight - pindex->nHeight < COINBASE_MATURITY; pindex = pindex->pprev)
-                    if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
-                        return error("ConnectInputs() : tried to spend coinbase at depth %d", pindexBlock->nHeight - pindex->nHeight);
+            {
+                int nDepth = GetAncestorDepth(pindexBlock, txindex.pos, COINBASE_MATURITY);
+                if (nDepth >= 0)
+                    return error("ConnectInputs() : tried to spend coinbase at depth %d", nDepth);
+            }
 
-            // Verify signature
-            if (!VerifySignature(txPrev, *this, i))
+            // Verify signature, or leave it to the caller
+            if (pvChecks)
+            {
+                if (prevout.hash != txPrev.GetHash())
+                    return error("ConnectInputs() : %s prev tx hash mismatch", GetHash().ToString().substr(0,10).c_str());
+                pvChecks->push_back(CSignatureCheck(txPrev.vout[prevout.n].scriptPubKey, *this, i));
+            }
+            else if (!VerifySignature(txPrev, *this, i))
                 return error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
             // Check for conflicts
@@ -978,14 +1128,14 @@ bool CTransaction::ClientConnectInputs()
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
-    if (!hooks->DisconnectBlock(*this, txdb, pindex))
-        return false;
-
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
         if (!vtx[i].DisconnectInputs(txdb, pindex))
             return false;
 
+    if (!hooks->DisconnectBlock(*this, txdb, pindex))
+        return false;
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1005,20 +1155,34 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     if (!CheckBlock(pindex->nHeight))
         return false;
 
+    CHashCounters hashcountersStart = GetHashCounters();
+
     //// issue here: it doesn't know the version
     unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(*this, SER_DISK|SER_BLOCKHEADERONLY) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapUnused;
+    vector<CSignatureCheck> vChecks;
     int64 nFees = 0;
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
         nTxPos += ::GetSerializeSize(tx, SER_DISK);
 
-        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex, nFees, true, false))
+        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex, nFees, true, false, 0, NULL, &vChecks))
             return false;
     }
 
+    // Signatures of the whole block are verified together before anything
+    // gets committed
+    unsigned int nSigCacheSize, nSigCacheMaxSize;
+    uint64 nSigCacheHitsStart, nSigCacheHits, nSigCacheMisses;
+    GetSignatureCacheStats(nSigCacheSize, nSigCacheMaxSize, nSigCacheHitsStart, nSigCacheMisses);
+    int64 nSignatureStart = GetTimeMillis();
+    if (!VerifySignatureChecks(vChecks))
+        return error("ConnectBlock() : signature verification failed");
+    int64 nSignatureTime = GetTimeMillis() - nSignatureStart;
+    GetSignatureCacheStats(nSigCacheSize, nSigCacheMaxSize, nSigCacheHits, nSigCacheMisses);
+
     if (vtx[0].GetValueOut() > GetBlockValue(pindex->nHeight, nFees))
         return false;
 
@@ -1036,7 +1200,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, true);
 
-    return hooks->ConnectBlock(*this, txdb, pindex);
+    if (!hooks->ConnectBlock(*this, txdb, pindex))
+        return false;
+
+    if (fBenchmark)
+        printf("ConnectBlock() : height %d, %d txs, %"PRI64u" hashes computed, %"PRI64u" served from cache, %d signatures verified in %"PRI64d"ms, %"PRI64u" from cache\n",
+               pindex->nHeight, vtx.size(), GetHashCounters().nComputed - hashcountersStart.nComputed, GetHashCounters().nCacheHits - hashcountersStart.nCacheHits,
+               vChecks.size(), nSignatureTime, nSigCacheHits - nSigCacheHitsStart);
+    return true;
 }
 
 bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
@@ -1150,11 +1321,15 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!ConnectBlock(txdb, pindexNew) || !txdb.WriteHashBestChain(hash))
         {
             txdb.TxnAbort();
+            hooks->AbortBlockTxn();
             InvalidChainFound(pindexNew);
             return error("SetBestChain() : ConnectBlock failed");
         }
         if (!txdb.TxnCommit())
+        {
+            hooks->AbortBlockTxn();
             return error("SetBestChain() : TxnCommit failed");
+        }
 
         // Add to current best branch
         pindexNew->pprev->pnext = pindexNew;
@@ -1169,6 +1344,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!Reorganize(txdb, pindexNew))
         {
             txdb.TxnAbort();
+            hooks->AbortBlockTxn();
             InvalidChainFound(pindexNew);
             return error("SetBestChain() : Reorganize failed");
         }
@@ -1185,15 +1361,202 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     hashBestChain = hash;
     pindexBest = pindexNew;
     nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexNew->bnChainWork;
+    SetActiveChainTip(pindexBest);
+    nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
-    printf("SetBestChain: new best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
+    printf("SetBestChain: new best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, nBestChainWork.ToString().c_str());
+
+    // Refresh the block index snapshot now and then, so a restart after a
+    // crash has few changed records to load on top of it
+    if (!IsInitialBlockDownload() && GetTime() - nLastBlockIndexSnapshot > BLOCK_INDEX_SNAPSHOT_INTERVAL)
+        WriteBlockIndexSnapshot(true);
 
     return true;
 }
 
 
+// vActiveChain holds the main chain by height.  Only the entries above the
+// fork with the previous chain are rewritten.
+void SetActiveChainTip(CBlockIndex* pindexTip)
+{
+    if (!pindexTip)
+    {
+        vActiveChain.clear();
+        return;
+    }
+    vActiveChain.resize(pindexTip->nHeight + 1);
+    for (CBlockIndex* pindex = pindexTip; pindex && vActiveChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vActiveChain[pindex->nHeight] = pindex;
+}
+
+CBlockIndex* GetActiveChainBlock(int nHeight)
+{
+    if (nHeight < 0 || nHeight >= vActiveChain.size())
+        return NULL;
+    return vActiveChain[nHeight];
+}
+
+// Block index entries live as long as the process, so they are handed out
+// from large contiguous chunks rather than allocated one by one.  Entries are
+// taken from vBlockIndexArena[nBlockIndexArenaChunk] until it is used up,
+// then from the chunks reserved after it.
+static const unsigned int BLOCK_INDEX_ARENA_CHUNK = 4096;
+static vector<pair<CBlockIndex*, unsigned int> > vBlockIndexArena;
+static unsigned int nBlockIndexArenaChunk = 0;
+static unsigned int nBlockIndexArenaUsed = 0;
+
+// Make room for nCount more entries.  The caller must hold cs_main.
+void ReserveBlockIndex(unsigned int nCount)
+{
+    // Grow the buckets only when they are too few, rehash() may otherwise
+    // rebuild or even shrink them
+    if (mapBlockIndex.bucket_count() * mapBlockIndex.max_load_factor() < mapBlockIndex.size() + nCount)
+        mapBlockIndex.rehash((mapBlockIndex.size() + nCount) / mapBlockIndex.max_load_factor() + 1);
+
+    unsigned int nFree = 0;
+    for (unsigned int i = nBlockIndexArenaChunk; i < vBlockIndexArena.size(); i++)
+        nFree += vBlockIndexArena[i].second - (i == nBlockIndexArenaChunk ? nBlockIndexArenaUsed : 0);
+    if (nFree >= nCount)
+        return;
+    nCount = max(nCount - nFree, BLOCK_INDEX_ARENA_CHUNK);
+    CBlockIndex* pchunk = new CBlockIndex[nCount];
+    if (!pchunk)
+        throw runtime_error("ReserveBlockIndex() : new CBlockIndex failed");
+    vBlockIndexArena.push_back(make_pair(pchunk, nCount));
+}
+
+// Find the block index entry for hash, or add a blank one for it.
+// The caller must hold cs_main.
+CBlockIndex* InsertBlockIndex(const uint256& hash)
+{
+    if (hash == 0)
+        return NULL;
+
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+
+    // Move on to the next chunk once this one is used up
+    if (vBlockIndexArena.empty() || nBlockIndexArenaUsed == vBlockIndexArena[nBlockIndexArenaChunk].second)
+    {
+        ReserveBlockIndex(1);
+        if (nBlockIndexArenaUsed == vBlockIndexArena[nBlockIndexArenaChunk].second)
+        {
+            nBlockIndexArenaChunk++;
+            nBlockIndexArenaUsed = 0;
+        }
+    }
+    CBlockIndex* pindexNew = &vBlockIndexArena[nBlockIndexArenaChunk].first[nBlockIndexArenaUsed++];
+    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    return pindexNew;
+}
+
+void GetBlockIndexArenaStats(int& nChunks, uint64& nBytes)
+{
+    nChunks = vBlockIndexArena.size();
+    nBytes = 0;
+    for (int i = 0; i < vBlockIndexArena.size(); i++)
+        nBytes += (uint64)vBlockIndexArena[i].second * sizeof(CBlockIndex);
+}
+
+// Block index entries by their position in the block files, so a CDiskTxPos
+// can be turned into a height without reading and hashing the block header.
+// mapBlockIndexByPos has its own lock, the name and wallet code look up
+// positions with only cs_mapWallet or no lock held.
+void AddBlockIndexPos(CBlockIndex* pindex)
+{
+    CRITICAL_BLOCK(cs_mapBlockIndexByPos)
+        mapBlockIndexByPos[((uint64)pindex->nFile << 32) | pindex->nBlockPos] = pindex;
+}
+
+CBlockIndex* GetBlockIndexAtPos(unsigned int nFile, unsigned int nBlockPos)
+{
+    CRITICAL_BLOCK(cs_mapBlockIndexByPos)
+    {
+        boost::unordered_map<uint64, CBlockIndex*>::iterator mi = mapBlockIndexByPos.find(((uint64)nFile << 32) | nBlockPos);
+        if (mi != mapBlockIndexByPos.end())
+            return (*mi).second;
+    }
+    return NULL;
+}
+
+// Turn off the lowest set bit
+static inline int InvertLowestOne(int n)
+{
+    return n & (n - 1);
+}
+
+// Height the skip pointer of a block at nHeight points to.  Odd heights skip
+// a little less far than even ones, which keeps GetAncestor logarithmic.
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nAncestorHeight)
+{
+    if (nAncestorHeight > nHeight || nAncestorHeight < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (pindexWalk && nHeightWalk > nAncestorHeight)
+    {
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        // Only follow pskip if it does not overshoot, and pprev->pskip would
+        // not get us there in fewer steps
+        if (pindexWalk->pskip && (nHeightSkip == nAncestorHeight ||
+             (nHeightSkip > nAncestorHeight && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nAncestorHeight))))
+        {
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        }
+        else
+        {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+// Depth of the block at pos below pindexBlock, or -1 if it is not an
+// ancestor of pindexBlock less than nMaxDepth blocks deep
+int GetAncestorDepth(CBlockIndex* pindexBlock, const CDiskTxPos& pos, int nMaxDepth)
+{
+    CBlockIndex* pindex = GetBlockIndexAtPos(pos.nFile, pos.nBlockPos);
+    if (!pindexBlock || !pindex || pindex->nHeight > pindexBlock->nHeight)
+        return -1;
+    int nDepth = pindexBlock->nHeight - pindex->nHeight;
+    if (nDepth >= nMaxDepth)
+        return -1;
+
+    // vActiveChain is always one whole chain, so a block in it, or one
+    // connected right on top of it, finds its ancestor by height.  Only
+    // the upper blocks of a branch being reorganized in use the skip list.
+    CBlockIndex* pindexAncestor;
+    if (nDepth == 0)
+        pindexAncestor = pindexBlock;
+    else if (GetActiveChainBlock(pindexBlock->nHeight) == pindexBlock || GetActiveChainBlock(pindexBlock->nHeight - 1) == pindexBlock->pprev)
+        pindexAncestor = GetActiveChainBlock(pindex->nHeight);
+    else
+        pindexAncestor = pindexBlock->GetAncestor(pindex->nHeight);
+    if (pindexAncestor != pindex)
+        return -1;
+    return nDepth;
+}
+
 bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 {
     // Check for duplicate
@@ -1202,27 +1565,33 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndex* pindexNew = InsertBlockIndex(hash);
+    const uint256* phashBlock = pindexNew->phashBlock;
+    *pindexNew = CBlockIndex(nFile, nBlockPos, *this);
+    pindexNew->phashBlock = phashBlock;
+    AddBlockIndexPos(pindexNew);
+    CacheAuxPow(pindexNew, auxpow);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
-    pindexNew->bnChainWork = (pindexNew->pprev ? pindexNew->pprev->bnChainWork : 0) + pindexNew->GetBlockWork();
+    pindexNew->BuildSkip();
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork();
 
     CTxDB txdb;
     txdb.TxnBegin();
-    txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
+    if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew)))
+    {
+        txdb.TxnAbort();
+        return error("AddToBlockIndex() : WriteBlockIndex failed");
+    }
     if (!txdb.TxnCommit())
         return false;
 
     // New best
-    if (pindexNew->bnChainWork > bnBestChainWork)
+    if (pindexNew->nChainWork > nBestChainWork)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
@@ -1343,7 +1712,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return error("AcceptBlock() : prev block not found");
     CBlockIndex* pindexPrev = (*mi).second;
@@ -1386,13 +1755,390 @@ bool CBlock::AcceptBlock()
     return true;
 }
 
+//
+// Block download manager.  Blocks announced by any peer are queued in the
+// order they were announced, which for getblocks replies is chain order.
+// Each peer is handed the earliest queued blocks it announced itself, within
+// a window that moves up as blocks connect, up to its own limit of requests
+// in flight.  Blocks that arrive ahead of their parent wait in the orphan
+// pool and ProcessBlock connects them in order once the gap is filled.
+// Requests holding up the front of the window are sent again to a faster
+// peer once overdue, and the slow peer's limit is halved.
+// Announcements cost memory and window slots before anything is known about
+// the blocks, so the queue is capped in total and per announcing peer, and
+// a hash is dropped once it failed a few requests, is too old, or a request
+// timed out on the only peer that announced it.
+// Everything here is guarded by cs_main.
+//
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const unsigned int BLOCK_DOWNLOAD_STALL_WINDOW = 16;
+static const int BLOCK_DOWNLOAD_START_IN_FLIGHT = 16;
+static const int BLOCK_DOWNLOAD_MAX_IN_FLIGHT = 64;
+static const int64 BLOCK_DOWNLOAD_STALL_MIN = 2 * 1000000;
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 60 * 1000000;
+static const int64 BLOCK_DOWNLOAD_LOCATOR_INTERVAL = 30 * 1000000;
+static const unsigned int BLOCK_DOWNLOAD_MAX_QUEUED = 4 * BLOCK_DOWNLOAD_WINDOW;
+static const int BLOCK_DOWNLOAD_MAX_PEER_QUEUED = BLOCK_DOWNLOAD_WINDOW / 2;
+static const int BLOCK_DOWNLOAD_MAX_REQUESTS = 4;
+
+class CBlockDownloader
+{
+protected:
+    class CPeer
+    {
+    public:
+        int nInFlight;
+        int nMaxInFlight;
+        int64 nAvgResponse;
+        uint64 nReceived;
+        int nStalls;
+        uint256 hashLastLocator;
+        int64 nLastLocatorTime;
+
+        CPeer()
+        {
+            nInFlight = 0;
+            nMaxInFlight = BLOCK_DOWNLOAD_START_IN_FLIGHT;
+            nAvgResponse = 0;
+            nReceived = 0;
+            nStalls = 0;
+            hashLastLocator = 0;
+            nLastLocatorTime = 0;
+        }
+
+        // How long a request may take before another peer is asked too
+        int64 GetStallTimeout() const
+        {
+            return std::max(BLOCK_DOWNLOAD_STALL_MIN, 4 * nAvgResponse);
+        }
+
+        void Stalled()
+        {
+            nStalls++;
+            nMaxInFlight = std::max(1, nMaxInFlight / 2);
+        }
+    };
+
+    class CRequest
+    {
+    public:
+        CNode* pnode;
+        int64 nTime;
+    };
+
+    class CQueued
+    {
+    public:
+        int64 nTimeQueued;
+        int64 nTimeRequested;
+        int nRequests;
+        unsigned int nPeer;
+    };
+
+    // Hashes can appear in vQueue more than once, mapQueued says which
+    // are still wanted.  mapPeerQueued counts the hashes in mapQueued by
+    // the IP of the peer that announced them first.
+    std::deque<uint256> vQueue;
+    std::map<uint256, CQueued> mapQueued;
+    std::map<unsigned int, int> mapPeerQueued;
+    std::multimap<uint256, CRequest> mapInFlight;
+    std::map<CNode*, CPeer> mapPeers;
+    uint256 hashLastBatch;
+    int64 nLastPrune;
+    uint64 nRerequested;
+
+    CPeer& GetPeer(CNode* pnode)
+    {
+        std::map<CNode*, CPeer>::iterator mi = mapPeers.find(pnode);
+        if (mi != mapPeers.end())
+            return (*mi).second;
+
+        // Hold on to the node until its requests are forgotten
+        CRITICAL_BLOCK(cs_vNodes)
+            pnode->AddRef();
+        return mapPeers[pnode];
+    }
+
+    void Forget(const uint256& hash)
+    {
+        std::map<uint256, CQueued>::iterator mi = mapQueued.find(hash);
+        if (mi == mapQueued.end())
+            return;
+        std::map<unsigned int, int>::iterator miPeer = mapPeerQueued.find((*mi).second.nPeer);
+        if (miPeer != mapPeerQueued.end() && --(*miPeer).second <= 0)
+            mapPeerQueued.erase(miPeer);
+        mapQueued.erase(mi);
+    }
+
+    // Whether a connected peer other than pnodeExcept announced the hash
+    bool IsAnnouncedElsewhere(const uint256& hash, CNode* pnodeExcept)
+    {
+        for (std::map<CNode*, CPeer>::iterator mi = mapPeers.begin(); mi != mapPeers.end(); mi++)
+        {
+            CNode* pnode = (*mi).first;
+            if (pnode == pnodeExcept || pnode->fDisconnect)
+                continue;
+            bool fAnnounced = false;
+            CRITICAL_BLOCK(pnode->cs_inventory)
+                fAnnounced = pnode->setInventoryKnown.count(CInv(MSG_BLOCK, hash));
+            if (fAnnounced)
+                return true;
+        }
+        return false;
+    }
+
+    void Prune(int64 nNow)
+    {
+        // Drop connected blocks off the front, and blocks that failed too
+        // many requests, were queued too long ago or that nobody has been
+        // asked for in a while, which no connected peer seems to have
+        while (!vQueue.empty())
+        {
+            const uint256& hash = vQueue.front();
+            std::map<uint256, CQueued>::iterator mi = mapQueued.find(hash);
+            if (mi != mapQueued.end() && !mapBlockIndex.count(hash))
+            {
+                const CQueued& queued = (*mi).second;
+                bool fStale = (queued.nRequests >= BLOCK_DOWNLOAD_MAX_REQUESTS ||
+                               nNow - queued.nTimeRequested > BLOCK_DOWNLOAD_TIMEOUT ||
+                               nNow - queued.nTimeQueued > BLOCK_DOWNLOAD_MAX_REQUESTS * BLOCK_DOWNLOAD_TIMEOUT);
+                if (poolOrphanBlocks.count(hash) || mapInFlight.count(hash) || !fStale)
+                    break;
+                printf("block download: giving up on %s\n", hash.ToString().substr(0,20).c_str());
+            }
+            Forget(hash);
+            vQueue.pop_front();
+        }
+
+        if (nNow - nLastPrune < 100000)
+            return;
+        nLastPrune = nNow;
+
+        // Give up on requests that timed out, so they can go to someone else
+        for (std::multimap<uint256, CRequest>::iterator mi = mapInFlight.begin(); mi != mapInFlight.end();)
+        {
+            CRequest& req = (*mi).second;
+            if (req.pnode->fDisconnect || nNow - req.nTime > BLOCK_DOWNLOAD_TIMEOUT)
+            {
+                CPeer& peer = mapPeers[req.pnode];
+                peer.nInFlight--;
+                if (!req.pnode->fDisconnect)
+                {
+                    peer.Stalled();
+
+                    // A peer may announce blocks it never serves
+                    std::map<uint256, CQueued>::iterator miQueued = mapQueued.find((*mi).first);
+                    if (miQueued != mapQueued.end() && mapInFlight.count((*mi).first) == 1 &&
+                        ((*miQueued).second.nRequests >= BLOCK_DOWNLOAD_MAX_REQUESTS || !IsAnnouncedElsewhere((*mi).first, req.pnode)))
+                    {
+                        printf("block download: dropping %s, timed out on %s\n", (*mi).first.ToString().substr(0,20).c_str(), req.pnode->addr.ToString().c_str());
+                        Forget((*mi).first);
+                    }
+                }
+                mapInFlight.erase(mi++);
+            }
+            else
+                mi++;
+        }
+
+        // Forget peers that went away, once nothing points at them
+        for (std::map<CNode*, CPeer>::iterator mi = mapPeers.begin(); mi != mapPeers.end();)
+        {
+            CNode* pnode = (*mi).first;
+            if (pnode->fDisconnect && (*mi).second.nInFlight == 0)
+            {
+                CRITICAL_BLOCK(cs_vNodes)
+                    pnode->Release();
+                mapPeers.erase(mi++);
+            }
+            else
+                mi++;
+        }
+    }
+
+public:
+    CBlockDownloader()
+    {
+        hashLastBatch = 0;
+        nLastPrune = 0;
+        nRerequested = 0;
+    }
+
+    bool IsQueued(const uint256& hash) const
+    {
+        return mapQueued.count(hash);
+    }
+
+    bool Queue(CNode* pfrom, const uint256& hash)
+    {
+        if (mapQueued.count(hash) || mapQueued.size() >= BLOCK_DOWNLOAD_MAX_QUEUED)
+            return false;
+        int& nPeerQueued = mapPeerQueued[pfrom->addr.ip];
+        if (nPeerQueued >= BLOCK_DOWNLOAD_MAX_PEER_QUEUED)
+            return false;
+        nPeerQueued++;
+
+        CQueued& queued = mapQueued[hash];
+        queued.nTimeQueued = queued.nTimeRequested = GetTimeMicros();
+        queued.nRequests = 0;
+        queued.nPeer = pfrom->addr.ip;
+        vQueue.push_back(hash);
+        return true;
+    }
+
+    // The last hash of a getblocks reply, where the next getblocks starts
+    void SetLastBatch(const uint256& hash)
+    {
+        hashLastBatch = hash;
+    }
+
+    void Received(CNode* pfrom, const uint256& hash, bool fAccepted)
+    {
+        int64 nNow = GetTimeMicros();
+        std::pair<std::multimap<uint256, CRequest>::iterator, std::multimap<uint256, CRequest>::iterator> range = mapInFlight.equal_range(hash);
+        for (std::multimap<uint256, CRequest>::iterator mi = range.first; mi != range.second; mi++)
+        {
+            CRequest& req = (*mi).second;
+            CPeer& peer = mapPeers[req.pnode];
+            peer.nInFlight--;
+            if (req.pnode == pfrom)
+            {
+                int64 nResponse = nNow - req.nTime;
+                peer.nAvgResponse = (peer.nAvgResponse == 0 ? nResponse : (3 * peer.nAvgResponse + nResponse) / 4);
+                peer.nReceived++;
+                peer.nMaxInFlight = std::min(BLOCK_DOWNLOAD_MAX_IN_FLIGHT, peer.nMaxInFlight + 1);
+            }
+        }
+        mapInFlight.erase(range.first, range.second);
+
+        // Don't fetch a block that failed its checks over and over
+        if (!fAccepted && !mapBlockIndex.count(hash) && !poolOrphanBlocks.count(hash))
+            Forget(hash);
+    }
+
+    void Schedule(CNode* pto, std::vector<CInv>& vGetData)
+    {
+        if (pto->fClient || pto->fDisconnect)
+            return;
+        int64 nNow = GetTimeMicros();
+        Prune(nNow);
+        CPeer& peer = GetPeer(pto);
+
+        // Ask for more hashes while the queue is shorter than the window and
+        // the peer had more blocks than we know about when it connected
+        if (vQueue.size() < BLOCK_DOWNLOAD_WINDOW && pto->nStartingHeight > nBestHeight + (int)mapQueued.size())
+        {
+            bool fContinue = (hashLastBatch != 0 && mapQueued.count(hashLastBatch));
+            uint256 hashHead = (fContinue ? hashLastBatch : hashBestChain);
+            if (hashHead != peer.hashLastLocator || nNow - peer.nLastLocatorTime > BLOCK_DOWNLOAD_LOCATOR_INTERVAL)
+            {
+                CBlockLocator locator(pindexBest);
+                if (fContinue)
+                    locator.Prepend(hashLastBatch);
+                peer.hashLastLocator = hashHead;
+                peer.nLastLocatorTime = nNow;
+                pto->nLastGetBlocksTime = GetTime();
+                pto->PushMessage("getblocks", locator, uint256(0));
+            }
+        }
+
+        // Only fill gaps while this peer's blocks crowd the orphan pool
+        unsigned int nWindow = std::min((unsigned int)vQueue.size(), BLOCK_DOWNLOAD_WINDOW);
+        if (poolOrphanBlocks.GetPeerSize(pto->addr.ip) > poolOrphanBlocks.GetMaxPeerSize() / 2 ||
+            poolOrphanBlocks.GetTotalSize() > poolOrphanBlocks.GetMaxSize() / 2)
+            nWindow = std::min(nWindow, BLOCK_DOWNLOAD_STALL_WINDOW);
+
+        for (unsigned int i = 0; i < nWindow && peer.nInFlight < peer.nMaxInFlight; i++)
+        {
+            const uint256& hash = vQueue[i];
+            std::map<uint256, CQueued>::iterator miQueued = mapQueued.find(hash);
+            if (miQueued == mapQueued.end() || mapBlockIndex.count(hash) || poolOrphanBlocks.count(hash))
+                continue;
+            CQueued& queued = (*miQueued).second;
+            if (queued.nRequests >= BLOCK_DOWNLOAD_MAX_REQUESTS)
+                continue;
+            bool fAnnounced = false;
+            CRITICAL_BLOCK(pto->cs_inventory)
+                fAnnounced = pto->setInventoryKnown.count(CInv(MSG_BLOCK, hash));
+            if (!fAnnounced)
+                continue;
+
+            std::multimap<uint256, CRequest>::iterator mi = mapInFlight.find(hash);
+            if (mi != mapInFlight.end())
+            {
+                // Ask a second peer only for blocks that hold up the front
+                // of the window, and only if it should be quicker than
+                // waiting some more for the first
+                if (i >= BLOCK_DOWNLOAD_STALL_WINDOW || mapInFlight.count(hash) > 1)
+                    continue;
+                CRequest& req = (*mi).second;
+                if (req.pnode == pto)
+                    continue;
+                CPeer& peerSlow = mapPeers[req.pnode];
+                int64 nElapsed = nNow - req.nTime;
+                int64 nExpected = (peer.nAvgResponse != 0 ? peer.nAvgResponse : BLOCK_DOWNLOAD_STALL_MIN);
+                if (nElapsed < peerSlow.GetStallTimeout() || 2 * nExpected > nElapsed)
+                    continue;
+                printf("block download: %s stalled on %s, asking %s\n", hash.ToString().substr(0,20).c_str(),
+                       req.pnode->addr.ToString().c_str(), pto->addr.ToString().c_str());
+                peerSlow.Stalled();
+                nRerequested++;
+            }
+
+            CRequest req;
+            req.pnode = pto;
+            req.nTime = nNow;
+            mapInFlight.insert(std::make_pair(hash, req));
+            queued.nTimeRequested = nNow;
+            queued.nRequests++;
+            peer.nInFlight++;
+            vGetData.push_back(CInv(MSG_BLOCK, hash));
+        }
+    }
+
+    void GetStats(unsigned int& nQueued, unsigned int& nInFlight, uint64& nRerequestedRet, std::vector<CBlockDownloadPeerStats>& vPeers) const
+    {
+        nQueued = mapQueued.size();
+        nInFlight = mapInFlight.size();
+        nRerequestedRet = nRerequested;
+        vPeers.clear();
+        for (std::map<CNode*, CPeer>::const_iterator mi = mapPeers.begin(); mi != mapPeers.end(); mi++)
+        {
+            const CPeer& peer = (*mi).second;
+            CBlockDownloadPeerStats stats;
+            stats.strAddr = (*mi).first->addr.ToString();
+            stats.nInFlight = peer.nInFlight;
+            stats.nMaxInFlight = peer.nMaxInFlight;
+            stats.nReceived = peer.nReceived;
+            stats.nAvgResponse = peer.nAvgResponse;
+            stats.nStalls = peer.nStalls;
+            vPeers.push_back(stats);
+        }
+    }
+};
+
+static CBlockDownloader blockDownloader;
+
+void GetBlockDownloadStats(unsigned int& nQueued, unsigned int& nInFlight, uint64& nRerequested, vector<CBlockDownloadPeerStats>& vPeers)
+{
+    CRITICAL_BLOCK(cs_main)
+        blockDownloader.GetStats(nQueued, nInFlight, nRerequested, vPeers);
+}
+
+// Whether the blocks an orphan is waiting for are already on their way
+bool static IsOrphanParentQueued(const uint256& hashRoot)
+{
+    CBlock* pblockRoot = poolOrphanBlocks.Get(hashRoot);
+    return pblockRoot && blockDownloader.IsQueued(pblockRoot->hashPrevBlock);
+}
+
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
     if (mapBlockIndex.count(hash))
         return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().substr(0,20).c_str());
-    if (mapOrphanBlocks.count(hash))
+    if (poolOrphanBlocks.count(hash))
         return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,20).c_str());
 
     // Preliminary checks
@@ -1406,11 +2152,12 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     {
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().substr(0,20).c_str());
         CBlock* pblock2 = new CBlock(*pblock);
-        mapOrphanBlocks.insert(make_pair(hash, pblock2));
-        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+        unsigned int nSize = ::GetSerializeSize(*pblock2, SER_NETWORK);
+        if (!poolOrphanBlocks.Add(hash, pblock2, vector<uint256>(1, pblock->hashPrevBlock), nSize, pfrom ? pfrom->addr.ip : 0))
+            return error("ProcessBlock() : orphan block %s too large for the orphan pool", hash.ToString().substr(0,20).c_str());
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless it's already on its way
+        if (pfrom && !IsOrphanParentQueued(GetOrphanRoot(pblock2)))
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
         return true;
     }
@@ -1424,18 +2171,14 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     vWorkQueue.push_back(hash);
     for (int i = 0; i < vWorkQueue.size(); i++)
     {
-        uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-             mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-             ++mi)
+        vector<uint256> vDependents = poolOrphanBlocks.GetDependents(vWorkQueue[i]);
+        BOOST_FOREACH(const uint256& hashOrphan, vDependents)
         {
-            CBlock* pblockOrphan = (*mi).second;
-            if (pblockOrphan->AcceptBlock())
-                vWorkQueue.push_back(pblockOrphan->GetHash());
-            mapOrphanBlocks.erase(pblockOrphan->GetHash());
-            delete pblockOrphan;
+            CBlock* pblockOrphan = poolOrphanBlocks.Get(hashOrphan);
+            if (pblockOrphan && pblockOrphan->AcceptBlock())
+                vWorkQueue.push_back(hashOrphan);
+            poolOrphanBlocks.Erase(hashOrphan);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
     }
 
     printf("ProcessBlock: ACCEPTED\n");
@@ -1465,88 +2208,565 @@ bool static ScanMessageStart(Stream& s)
             s.read(&c, 1);
             if (s.fail())
             {
-                s.clear(0);
-                s.exceptions(prevmask);
-                return false;
+                s.clear(0);
+                s.exceptions(prevmask);
+                return false;
+            }
+            if (*p != c)
+                p = BEGIN(pchMessageStart);
+            if (*p == c)
+            {
+                if (++p == END(pchMessageStart))
+                {
+                    s.clear(0);
+                    s.exceptions(prevmask);
+                    return true;
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        s.clear(0);
+        s.exceptions(prevmask);
+        return false;
+    }
+}
+
+bool CheckDiskSpace(uint64 nAdditionalBytes)
+{
+    uint64 nFreeBytesAvailable = filesystem::space(GetDataDir()).available;
+
+    // Check for 15MB because database could create another 10MB log file at any time
+    if (nFreeBytesAvailable < (uint64)15000000 + nAdditionalBytes)
+    {
+        fShutdown = true;
+        string strMessage = _("Warning: Disk space is low  ");
+        strMiscWarning = strMessage;
+        printf("*** %s\n", strMessage.c_str());
+        ThreadSafeMessageBox(strMessage, "Bitcoin", wxOK | wxICON_EXCLAMATION);
+        CreateThread(Shutdown, NULL);
+        return false;
+    }
+    return true;
+}
+
+FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
+{
+    if (nFile == -1)
+        return NULL;
+    FILE* file = fopen(strprintf("%s/blk%04d.dat", GetDataDir().c_str(), nFile).c_str(), pszMode);
+    if (!file)
+        return NULL;
+    if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
+    {
+        if (fseek(file, nBlockPos, SEEK_SET) != 0)
+        {
+            fclose(file);
+            return NULL;
+        }
+    }
+    return file;
+}
+
+//
+// Block files are read through read-only mappings cached per file, instead of
+// an fopen and fseek for every block and transaction read.  A mapping covers
+// the file as it was when mapped; WriteToDisk drops the mapping of the file
+// it appended to, so the next read maps the grown file.
+//
+
+static const unsigned int MAX_BLOCK_FILE_MAPPINGS = 8;
+
+static CCriticalSection cs_mapBlockFileMappings;
+static map<unsigned int, pair<boost::shared_ptr<CBlockFileMapping>, unsigned int> > mapBlockFileMappings;
+static unsigned int nBlockFileMappingUse = 0;
+
+CBlockFileMapping::~CBlockFileMapping()
+{
+#ifndef __WXMSW__
+    if (pbegin)
+        munmap((void*)pbegin, nSize);
+#endif
+}
+
+boost::shared_ptr<CBlockFileMapping> MapBlockFile(unsigned int nFile, unsigned int nBlockPos)
+{
+    boost::shared_ptr<CBlockFileMapping> mapping;
+#ifndef __WXMSW__
+    if (nFile == -1)
+        return mapping;
+
+    CRITICAL_BLOCK(cs_mapBlockFileMappings)
+    {
+        map<unsigned int, pair<boost::shared_ptr<CBlockFileMapping>, unsigned int> >::iterator mi = mapBlockFileMappings.find(nFile);
+        if (mi != mapBlockFileMappings.end() && nBlockPos < (*mi).second.first->GetSize())
+        {
+            (*mi).second.second = ++nBlockFileMappingUse;
+            return (*mi).second.first;
+        }
+
+        int fd = open(strprintf("%s/blk%04d.dat", GetDataDir().c_str(), nFile).c_str(), O_RDONLY);
+        if (fd == -1)
+            return mapping;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= nBlockPos)
+        {
+            close(fd);
+            return mapping;
+        }
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return mapping;
+        mapping.reset(new CBlockFileMapping((const char*)p, st.st_size));
+
+        // Evict the least recently used mapping, readers still holding it
+        // keep it alive
+        if (mi == mapBlockFileMappings.end() && mapBlockFileMappings.size() >= MAX_BLOCK_FILE_MAPPINGS)
+        {
+            map<unsigned int, pair<boost::shared_ptr<CBlockFileMapping>, unsigned int> >::iterator miOldest = mapBlockFileMappings.begin();
+            for (mi = mapBlockFileMappings.begin(); mi != mapBlockFileMappings.end(); ++mi)
+                if ((*mi).second.second < (*miOldest).second.second)
+                    miOldest = mi;
+            mapBlockFileMappings.erase(miOldest);
+        }
+        mapBlockFileMappings[nFile] = make_pair(mapping, ++nBlockFileMappingUse);
+    }
+#endif
+    return mapping;
+}
+
+void UnmapBlockFile(unsigned int nFile)
+{
+    CRITICAL_BLOCK(cs_mapBlockFileMappings)
+        mapBlockFileMappings.erase(nFile);
+}
+
+static unsigned int nCurrentBlockFile = 1;
+
+FILE* AppendBlockFile(unsigned int& nFileRet)
+{
+    nFileRet = 0;
+    loop
+    {
+        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
+        if (!file)
+            return NULL;
+        if (fseek(file, 0, SEEK_END) != 0)
+            return NULL;
+        // FAT32 filesize max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
+        if (ftell(file) < 0x7F000000 - MAX_SIZE)
+        {
+            nFileRet = nCurrentBlockFile;
+            return file;
+        }
+        fclose(file);
+        nCurrentBlockFile++;
+    }
+}
+
+//
+// Block index snapshot.  blkindex.snap holds every block index entry in
+// height order with its chain work, and a stamp that is also written to
+// blkindex.dat.  Block files are only ever appended to, so the blocks
+// stored since the snapshot are the ones after its last entry in the
+// block files.  At startup the snapshot plus the index records of those
+// few blocks give the block index without walking all the blockindex
+// records.
+//
+
+static const int BLOCK_INDEX_SNAPSHOT_VERSION = 4;
+
+class CBlockIndexSnapshotEntry
+{
+public:
+    uint256 hashBlock;
+    int nPrev;
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    int nHeight;
+    uint256 nChainWork;
+    int nVersion;
+    uint256 hashMerkleRoot;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+
+    // memory only
+    uint256 hashPrev;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(nPrev);
+        READWRITE(nFile);
+        READWRITE(nBlockPos);
+        READWRITE(nHeight);
+        READWRITE(nChainWork);
+        READWRITE(this->nVersion);
+        READWRITE(hashMerkleRoot);
+        READWRITE(nTime);
+        READWRITE(nBits);
+        READWRITE(nNonce);
+    )
+};
+
+static CCriticalSection cs_BlockIndexSnapshot;
+
+static string GetBlockIndexSnapshotFile()
+{
+    return GetDataDir() + "/blkindex.snap";
+}
+
+// Sorts, serializes and writes entries copied from the block index, without
+// holding cs_main
+bool static WriteBlockIndexSnapshotEntries(vector<CBlockIndexSnapshotEntry>* pvEntriesIn)
+{
+    auto_ptr<vector<CBlockIndexSnapshotEntry> > pvEntries(pvEntriesIn);
+    vector<CBlockIndexSnapshotEntry>& vEntries = *pvEntries;
+
+    CRITICAL_BLOCK(cs_BlockIndexSnapshot)
+    {
+        vector<pair<int, int> > vSortedByHeight;
+        vSortedByHeight.reserve(vEntries.size());
+        for (int i = 0; i < vEntries.size(); i++)
+            vSortedByHeight.push_back(make_pair(vEntries[i].nHeight, i));
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+        map<uint256, int> mapPos;
+        CDataStream ssEntries(SER_DISK);
+        unsigned int nTailFile = 0;
+        unsigned int nTailPos = 0;
+        for (int i = 0; i < vSortedByHeight.size(); i++)
+        {
+            CBlockIndexSnapshotEntry& entry = vEntries[vSortedByHeight[i].second];
+            entry.nPrev = -1;
+            if (entry.hashPrev != 0)
+            {
+                map<uint256, int>::iterator mi = mapPos.find(entry.hashPrev);
+                if (mi == mapPos.end())
+                    return error("WriteBlockIndexSnapshot() : parent of %s not found", entry.hashBlock.ToString().substr(0,20).c_str());
+                entry.nPrev = (*mi).second;
+            }
+            mapPos[entry.hashBlock] = i;
+            if (make_pair(entry.nFile, entry.nBlockPos) > make_pair(nTailFile, nTailPos))
+            {
+                nTailFile = entry.nFile;
+                nTailPos = entry.nBlockPos;
+            }
+            ssEntries << entry;
+        }
+
+        uint64 nStamp = 1 + GetRand(~(uint64)0 - 1);
+        CDataStream ssHeader(SER_DISK);
+        ssHeader << BLOCK_INDEX_SNAPSHOT_VERSION << nStamp << hashGenesisBlock
+                 << (int)vSortedByHeight.size() << nTailFile << nTailPos
+                 << Hash(ssEntries.begin(), ssEntries.end());
+
+        // Write to a temporary file and rename it over the old snapshot.  The
+        // stamp in blkindex.dat still names the old one until it is rewritten
+        // below, so a crash in between just falls back to the records.
+        string strTmp = GetBlockIndexSnapshotFile() + ".new";
+        FILE* file = fopen(strTmp.c_str(), "wb");
+        if (!file)
+            return error("WriteBlockIndexSnapshot() : open failed");
+        bool fWritten = (fwrite(&ssHeader[0], 1, ssHeader.size(), file) == ssHeader.size() &&
+                         fwrite(&ssEntries[0], 1, ssEntries.size(), file) == ssEntries.size() &&
+                         fflush(file) == 0);
+#ifdef __WXMSW__
+        _commit(_fileno(file));
+#else
+        fsync(fileno(file));
+#endif
+        fclose(file);
+        if (!fWritten)
+            return error("WriteBlockIndexSnapshot() : write failed");
+        try
+        {
+            filesystem::remove(GetBlockIndexSnapshotFile());
+            filesystem::rename(strTmp, GetBlockIndexSnapshotFile());
+        }
+        catch (filesystem::filesystem_error& e)
+        {
+            return error("WriteBlockIndexSnapshot() : %s", e.what());
+        }
+
+        CTxDB txdb;
+        if (!txdb.WriteBlockIndexSnapshotStamp(nStamp))
+            return error("WriteBlockIndexSnapshot() : failed to write stamp");
+        printf("WriteBlockIndexSnapshot() : %d entries\n", vSortedByHeight.size());
+    }
+    return true;
+}
+
+void ThreadWriteBlockIndexSnapshot(void* parg)
+{
+    WriteBlockIndexSnapshotEntries((vector<CBlockIndexSnapshotEntry>*)parg);
+}
+
+bool WriteBlockIndexSnapshot(bool fAsync)
+{
+    // Only the copy is made under cs_main
+    vector<CBlockIndexSnapshotEntry>* pvEntries = new vector<CBlockIndexSnapshotEntry>();
+    CRITICAL_BLOCK(cs_main)
+    {
+        if (!pindexBest)
+        {
+            delete pvEntries;
+            return false;
+        }
+        nLastBlockIndexSnapshot = GetTime();
+
+        pvEntries->reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            CBlockIndexSnapshotEntry entry;
+            entry.hashBlock = pindex->GetBlockHash();
+            entry.hashPrev = (pindex->pprev ? pindex->pprev->GetBlockHash() : 0);
+            entry.nFile = pindex->nFile;
+            entry.nBlockPos = pindex->nBlockPos;
+            entry.nHeight = pindex->nHeight;
+            entry.nChainWork = pindex->nChainWork;
+            entry.nVersion = pindex->nVersion;
+            entry.hashMerkleRoot = pindex->hashMerkleRoot;
+            entry.nTime = pindex->nTime;
+            entry.nBits = pindex->nBits;
+            entry.nNonce = pindex->nNonce;
+            pvEntries->push_back(entry);
+        }
+    }
+
+    if (fAsync)
+    {
+        if (!CreateThread(ThreadWriteBlockIndexSnapshot, pvEntries))
+        {
+            delete pvEntries;
+            return error("WriteBlockIndexSnapshot() : CreateThread failed");
+        }
+        return true;
+    }
+    return WriteBlockIndexSnapshotEntries(pvEntries);
+}
+
+// Index records of the blocks stored in the block files from nFile,
+// nBlockPos on, checked like LoadBlockIndexRecords checks them.  A torn
+// write left by a crash is skipped by looking for the next block.
+bool static ReadBlockIndexTail(CTxDB& txdb, unsigned int nFile, unsigned int nBlockPos, const map<uint256, int>& mapKnown, vector<CDiskBlockIndex>& vTail)
+{
+    unsigned int nPos = (nBlockPos >= 8 ? nBlockPos - 8 : 0);
+    for (;; nFile++, nPos = 0)
+    {
+        CAutoFile filein = OpenBlockFile(nFile, 0, "rb");
+        if (!filein)
+            break;
+        filein.nType |= SER_BLOCKHEADERONLY;
+        loop
+        {
+            // Blocks are stored after the message start and their size
+            char pchStart[sizeof(pchMessageStart)];
+            unsigned int nSize;
+            if (fseek(filein, nPos, SEEK_SET) != 0 ||
+                fread(pchStart, 1, sizeof(pchStart), filein) != sizeof(pchStart) ||
+                fread(&nSize, 1, sizeof(nSize), filein) != sizeof(nSize))
+                break;
+            if (memcmp(pchStart, pchMessageStart, sizeof(pchStart)) != 0 || nSize > MAX_SIZE)
+            {
+                nPos++;
+                continue;
+            }
+
+            CBlock block;
+            try
+            {
+                filein >> block;
             }
-            if (*p != c)
-                p = BEGIN(pchMessageStart);
-            if (*p == c)
+            catch (std::exception& e)
             {
-                if (++p == END(pchMessageStart))
+                break;
+            }
+            uint256 hash = block.GetHash();
+            CDiskBlockIndex diskindex;
+            if (!mapKnown.count(hash))
+            {
+                if (!txdb.ReadBlockIndex(hash, diskindex) || diskindex.nFile != nFile || diskindex.nBlockPos != nPos + 8)
                 {
-                    s.clear(0);
-                    s.exceptions(prevmask);
-                    return true;
+                    // Not a block, or one that never made it into the index
+                    nPos++;
+                    continue;
                 }
+                if (!diskindex.CheckIndex())
+                    return error("LoadBlockIndexSnapshot() : CheckIndex failed at %d", diskindex.nHeight);
+                vTail.push_back(diskindex);
             }
+            nPos += 8 + nSize;
         }
     }
-    catch (...)
-    {
-        s.clear(0);
-        s.exceptions(prevmask);
-        return false;
-    }
+    return true;
 }
 
-bool CheckDiskSpace(uint64 nAdditionalBytes)
+bool LoadBlockIndexSnapshot(CTxDB& txdb)
 {
-    uint64 nFreeBytesAvailable = filesystem::space(GetDataDir()).available;
+    uint64 nStampDB;
+    uint256 hashBestDB;
+    if (!txdb.ReadBlockIndexSnapshotStamp(nStampDB) || nStampDB == 0 || !txdb.ReadHashBestChain(hashBestDB))
+        return false;
 
-    // Check for 15MB because database could create another 10MB log file at any time
-    if (nFreeBytesAvailable < (uint64)15000000 + nAdditionalBytes)
+    // Read the whole file
+    CDataStream ss(SER_DISK);
     {
-        fShutdown = true;
-        string strMessage = _("Warning: Disk space is low  ");
-        strMiscWarning = strMessage;
-        printf("*** %s\n", strMessage.c_str());
-        ThreadSafeMessageBox(strMessage, "Bitcoin", wxOK | wxICON_EXCLAMATION);
-        CreateThread(Shutdown, NULL);
-        return false;
+        CAutoFile filein = fopen(GetBlockIndexSnapshotFile().c_str(), "rb");
+        if (!filein)
+            return false;
+        if (fseek(filein, 0, SEEK_END) != 0)
+            return false;
+        long nSize = ftell(filein);
+        if (nSize <= 0 || fseek(filein, 0, SEEK_SET) != 0)
+            return false;
+        ss.resize(nSize);
+        if (fread(&ss[0], 1, nSize, filein) != nSize)
+            return false;
     }
-    return true;
-}
 
-FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
-{
-    if (nFile == -1)
-        return NULL;
-    FILE* file = fopen(strprintf("%s/blk%04d.dat", GetDataDir().c_str(), nFile).c_str(), pszMode);
-    if (!file)
-        return NULL;
-    if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
+    vector<CBlockIndexSnapshotEntry> vEntries;
+    unsigned int nTailFile, nTailPos;
+    try
     {
-        if (fseek(file, nBlockPos, SEEK_SET) != 0)
+        int nVersion;
+        uint64 nStamp;
+        uint256 hashGenesis;
+        int nEntries;
+        uint256 hashEntries;
+        ss >> nVersion;
+        if (nVersion != BLOCK_INDEX_SNAPSHOT_VERSION)
         {
-            fclose(file);
-            return NULL;
+            printf("LoadBlockIndexSnapshot() : snapshot is out of date\n");
+            return false;
+        }
+        ss >> nStamp >> hashGenesis >> nEntries >> nTailFile >> nTailPos >> hashEntries;
+        if (nStamp != nStampDB || hashGenesis != hashGenesisBlock)
+        {
+            printf("LoadBlockIndexSnapshot() : snapshot is out of date\n");
+            return false;
+        }
+        if (Hash(ss.begin(), ss.end()) != hashEntries)
+            return error("LoadBlockIndexSnapshot() : checksum mismatch");
+
+        vEntries.resize(nEntries);
+        for (int i = 0; i < nEntries; i++)
+        {
+            ss >> vEntries[i];
+            if (vEntries[i].nPrev >= i)
+                return error("LoadBlockIndexSnapshot() : entries out of order");
         }
     }
-    return file;
-}
+    catch (std::exception& e)
+    {
+        return error("LoadBlockIndexSnapshot() : %s", e.what());
+    }
 
-static unsigned int nCurrentBlockFile = 1;
+    // The snapshot only holds entries that passed CheckIndex when they were
+    // accepted or loaded from the records.  Each header is still hashed again
+    // here and, as in CheckIndex, checked against its own proof of work.  For
+    // merge mined entries CheckIndex checks the parent block's proof of
+    // work, which needs the auxpow from the block file.  Reading those is
+    // what the snapshot avoids, so for them only the checksum covers it.
+    map<uint256, int> mapPos;
+    for (int i = 0; i < vEntries.size(); i++)
+    {
+        const CBlockIndexSnapshotEntry& entry = vEntries[i];
+        CBlock block;
+        block.nVersion       = entry.nVersion;
+        block.hashPrevBlock  = (entry.nPrev >= 0 ? vEntries[entry.nPrev].hashBlock : 0);
+        block.hashMerkleRoot = entry.hashMerkleRoot;
+        block.nTime          = entry.nTime;
+        block.nBits          = entry.nBits;
+        block.nNonce         = entry.nNonce;
+        if (block.GetHash() != entry.hashBlock)
+            return error("LoadBlockIndexSnapshot() : entry %d does not match its hash", i);
+        if (!(entry.nVersion & BLOCK_VERSION_AUXPOW) && !CheckProofOfWork(entry.hashBlock, entry.nBits))
+            return error("LoadBlockIndexSnapshot() : CheckIndex failed at %d", entry.nHeight);
+        mapPos[entry.hashBlock] = i;
+    }
 
-FILE* AppendBlockFile(unsigned int& nFileRet)
-{
-    nFileRet = 0;
-    loop
+    // Blocks stored since the snapshot, appended in height order
+    int nSnapshotEntries = vEntries.size();
+    vector<CDiskBlockIndex> vTail;
+    if (!ReadBlockIndexTail(txdb, nTailFile, nTailPos, mapPos, vTail))
+        return false;
+    vector<pair<int, int> > vSortedByHeight;
+    for (int i = 0; i < vTail.size(); i++)
+        vSortedByHeight.push_back(make_pair(vTail[i].nHeight, i));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    for (int i = 0; i < vSortedByHeight.size(); i++)
     {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-        if (!file)
-            return NULL;
-        if (fseek(file, 0, SEEK_END) != 0)
-            return NULL;
-        // FAT32 filesize max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < 0x7F000000 - MAX_SIZE)
+        const CDiskBlockIndex& diskindex = vTail[vSortedByHeight[i].second];
+        CBlockIndexSnapshotEntry entry;
+        entry.hashBlock = diskindex.GetBlockHash();
+        entry.nPrev = -1;
+        if (diskindex.hashPrev != 0)
         {
-            nFileRet = nCurrentBlockFile;
-            return file;
+            map<uint256, int>::iterator mi = mapPos.find(diskindex.hashPrev);
+            if (mi == mapPos.end())
+                return error("LoadBlockIndexSnapshot() : parent of stored block %s not found", entry.hashBlock.ToString().substr(0,20).c_str());
+            entry.nPrev = (*mi).second;
         }
-        fclose(file);
-        nCurrentBlockFile++;
+        entry.nFile = diskindex.nFile;
+        entry.nBlockPos = diskindex.nBlockPos;
+        entry.nHeight = diskindex.nHeight;
+        entry.nVersion = diskindex.nVersion;
+        entry.hashMerkleRoot = diskindex.hashMerkleRoot;
+        entry.nTime = diskindex.nTime;
+        entry.nBits = diskindex.nBits;
+        entry.nNonce = diskindex.nNonce;
+        mapPos[entry.hashBlock] = vEntries.size();
+        vEntries.push_back(entry);
+    }
+    if (!mapPos.count(hashBestDB))
+    {
+        printf("LoadBlockIndexSnapshot() : best block not found after the snapshot\n");
+        return false;
+    }
+
+    // Everything checked out, build the block index
+    vector<CBlockIndex*> vIndex(vEntries.size());
+    ReserveBlockIndex(vEntries.size());
+    for (int i = 0; i < vEntries.size(); i++)
+    {
+        const CBlockIndexSnapshotEntry& entry = vEntries[i];
+        CBlockIndex* pindexNew = InsertBlockIndex(entry.hashBlock);
+        pindexNew->pprev          = (entry.nPrev >= 0 ? vIndex[entry.nPrev] : NULL);
+        pindexNew->nFile          = entry.nFile;
+        pindexNew->nBlockPos      = entry.nBlockPos;
+        pindexNew->nHeight        = entry.nHeight;
+        pindexNew->nVersion       = entry.nVersion;
+        pindexNew->hashMerkleRoot = entry.hashMerkleRoot;
+        pindexNew->nTime          = entry.nTime;
+        pindexNew->nBits          = entry.nBits;
+        pindexNew->nNonce         = entry.nNonce;
+        if (i < nSnapshotEntries)
+            pindexNew->nChainWork = entry.nChainWork;
+        else
+            pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork();
+        pindexNew->BuildSkip();
+        AddBlockIndexPos(pindexNew);
+        vIndex[i] = pindexNew;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && entry.hashBlock == hashGenesisBlock)
+            pindexGenesisBlock = pindexNew;
     }
+
+    // pnext links the main chain
+    BlockMap::iterator mi = mapBlockIndex.find(hashBestDB);
+    if (mi != mapBlockIndex.end())
+        for (CBlockIndex* pindex = (*mi).second; pindex->pprev; pindex = pindex->pprev)
+            pindex->pprev->pnext = pindex;
+
+    nLastBlockIndexSnapshot = GetTime();
+    printf("LoadBlockIndexSnapshot() : loaded %d entries, %d stored since the snapshot\n", vEntries.size(), vTail.size());
+    return true;
 }
 
 bool LoadBlockIndex(bool fAllowNew)
@@ -1554,7 +2774,7 @@ bool LoadBlockIndex(bool fAllowNew)
     if (fTestNet)
     {
         hashGenesisBlock = uint256("0x00000007199508e34a9ff81e6ec0c477a4cccff2a4767a8eee39c11db367b008");
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 28);
+        nProofOfWorkLimit = ~uint256(0) >> 28;
         pchMessageStart[0] = 0xfa;
         pchMessageStart[1] = 0xbf;
         pchMessageStart[2] = 0xb5;
@@ -1639,7 +2859,7 @@ void PrintBlockTree()
 {
     // precompute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -1740,7 +2960,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && bnBestInvalidWork > bnBestChainWork + pindexBest->GetBlockWork() * 6)
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = "WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.";
@@ -1848,13 +3068,45 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 {
     switch (inv.type)
     {
-    case MSG_TX:    return mapTransactions.count(inv.hash) || mapOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
-    case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
+    case MSG_TX:    return mapTransactions.count(inv.hash) || poolOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
+    case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || poolOrphanBlocks.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
 }
 
+// Uncached auxpows read from the block files for a single getheaders reply
+static const int MAX_GETHEADERS_AUXPOW_READS = 250;
+
+// Block messages recently served to getdata, so a block that several
+// syncing peers ask for is read and serialized once and the same buffer is
+// queued to all of them.  Guarded by cs_main.
+static const unsigned int MAX_BLOCK_MESSAGE_CACHE = 16;
+static map<pair<uint256, int>, SendBuffer> mapBlockMessages;
+static deque<pair<uint256, int> > vBlockMessagesAge;
+
+SendBuffer static GetBlockMessage(CBlockIndex* pindex, int nVersion)
+{
+    pair<uint256, int> key(pindex->GetBlockHash(), nVersion);
+    map<pair<uint256, int>, SendBuffer>::iterator mi = mapBlockMessages.find(key);
+    if (mi != mapBlockMessages.end())
+        return (*mi).second;
+
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+        return SendBuffer();
+    SendBuffer buf = MakeSendBuffer("block", block, nVersion);
+
+    if (vBlockMessagesAge.size() >= MAX_BLOCK_MESSAGE_CACHE)
+    {
+        mapBlockMessages.erase(vBlockMessagesAge.front());
+        vBlockMessagesAge.pop_front();
+    }
+    mapBlockMessages.insert(make_pair(key, buf));
+    vBlockMessagesAge.push_back(key);
+    return buf;
+}
+
 
 
 
@@ -1925,7 +3177,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->PushMessage("verack");
         pfrom->vSend.SetVersion(min(pfrom->nVersion, VERSION));
         if (pfrom->nVersion < 209)
-            pfrom->vRecv.SetVersion(min(pfrom->nVersion, VERSION));
+            pfrom->SetRecvVersion(min(pfrom->nVersion, VERSION));
 
         if (!pfrom->fInbound)
         {
@@ -1973,7 +3225,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, VERSION));
     }
 
 
@@ -2045,7 +3297,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (vInv.size() > 50000)
             return error("message inv size() = %d", vInv.size());
 
+        // Several blocks in one inv is a getblocks reply, queue them only if
+        // we asked, so the batch starts from our own chain
+        int nBlocks = 0;
+        BOOST_FOREACH(const CInv& inv, vInv)
+            if (inv.type == MSG_BLOCK)
+                nBlocks++;
+        bool fQueueBlocks = (nBlocks <= 1 || GetTime() - pfrom->nLastGetBlocksTime < 10 * 60);
+
         CTxDB txdb("r");
+        uint256 hashLastBlock = 0;
         BOOST_FOREACH(const CInv& inv, vInv)
         {
             if (fShutdown)
@@ -2055,14 +3316,31 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave)
+            if (inv.type == MSG_BLOCK)
+            {
+                if (!fAlreadyHave)
+                {
+                    // Any peer that announced it may be asked for it
+                    if (fQueueBlocks && blockDownloader.Queue(pfrom, inv.hash))
+                        hashLastBlock = inv.hash;
+                }
+                else if (poolOrphanBlocks.count(inv.hash))
+                {
+                    uint256 hashRoot = GetOrphanRoot(poolOrphanBlocks.Get(inv.hash));
+                    if (!IsOrphanParentQueued(hashRoot))
+                        pfrom->PushGetBlocks(pindexBest, hashRoot);
+                }
+            }
+            else if (!fAlreadyHave)
                 pfrom->AskFor(inv);
-            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash))
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
 
             // Track requests for our stuff
             Inventory(inv.hash);
         }
+
+        // A getblocks reply, the next one can start where it ended
+        if (nBlocks > 1 && hashLastBlock != 0)
+            blockDownloader.SetLastBatch(hashLastBlock);
     }
 
 
@@ -2082,12 +3360,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    SendBuffer buf = GetBlockMessage((*mi).second, pfrom->vSend.GetVersion());
+                    if (buf)
+                        pfrom->PushSendBuffer("block", buf);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -2167,7 +3445,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -2182,10 +3460,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         vector<CBlock> vHeaders;
         int nLimit = 2000 + locator.GetDistanceBack();
+        int nAuxPowReads = 0;
         printf("getheaders %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str(), nLimit);
         for (; pindex; pindex = pindex->pnext)
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
+            // Auxpows not in the cache cost a disk read each, stop early
+            // and let the peer ask again from where this reply ends
+            if ((pindex->nVersion & BLOCK_VERSION_AUXPOW) && !pindex->GetCachedAuxPow())
+                if (++nAuxPowReads > MAX_GETHEADERS_AUXPOW_READS)
+                    break;
+            CBlock block = pindex->GetBlockHeader(false);
+            if ((block.nVersion & BLOCK_VERSION_AUXPOW) && !block.auxpow)
+            {
+                // Never send a header that fails to deserialize, the rest
+                // of the chain can't follow it either
+                error("getheaders : auxpow of block %s unavailable", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+                break;
+            }
+            vHeaders.push_back(block);
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
@@ -2215,12 +3507,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             // Recursively process any orphan transactions that depended on this one
             for (int i = 0; i < vWorkQueue.size(); i++)
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(hashPrev);
-                     mi != mapOrphanTransactionsByPrev.upper_bound(hashPrev);
-                     ++mi)
+                vector<uint256> vDependents = poolOrphanTransactions.GetDependents(vWorkQueue[i]);
+                BOOST_FOREACH(const uint256& hashOrphan, vDependents)
                 {
-                    const CDataStream& vMsg = *((*mi).second);
+                    const CDataStream* pvMsg = poolOrphanTransactions.Get(hashOrphan);
+                    if (!pvMsg)
+                        continue;
+                    const CDataStream& vMsg = *pvMsg;
                     CTransaction tx;
                     CDataStream(vMsg) >> tx;
                     CInv inv(MSG_TX, tx.GetHash());
@@ -2237,12 +3530,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
 
             BOOST_FOREACH(uint256 hash, vWorkQueue)
-                EraseOrphanTx(hash);
+                poolOrphanTransactions.Erase(hash);
         }
         else if (fMissingInputs)
         {
             printf("storing orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-            AddOrphanTx(vMsg);
+            AddOrphanTx(vMsg, pfrom->addr.ip);
         }
     }
 
@@ -2258,7 +3551,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (ProcessBlock(pfrom, &block))
+        bool fAccepted = ProcessBlock(pfrom, &block);
+        blockDownloader.Received(pfrom, inv.hash, fAccepted);
+        if (fAccepted)
             mapAlreadyAskedFor.erase(inv);
     }
 
@@ -2372,12 +3667,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
 bool ProcessMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
-    //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
-
     //
     // Message format
     //  (4) message start
@@ -2386,68 +3675,48 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
-
-    loop
+    // The socket thread has already split the stream into messages.  Take
+    // the complete ones off the node so it can keep receiving meanwhile.
+    //
+    list<CNetMessage> vMsgs;
+    CRITICAL_BLOCK(pfrom->cs_vRecv)
     {
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
+        list<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
+        while (it != pfrom->vRecvMsg.end() && (*it).IsComplete())
         {
-            if (vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
-            break;
+            pfrom->nRecvQueueSize -= (*it).vRecv.size();
+            it++;
         }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %d BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
+        vMsgs.splice(vMsgs.end(), pfrom->vRecvMsg, pfrom->vRecvMsg.begin(), it);
+    }
+    //if (fDebug)
+    //    printf("ProcessMessages(%u messages)\n", vMsgs.size());
 
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
-        {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
-        }
-        string strCommand = hdr.GetCommand();
+    for (; !vMsgs.empty(); vMsgs.pop_front())
+    {
+        CNetMessage& msg = vMsgs.front();
+        CDataStream& vMsg = msg.vRecv;
+        string strCommand = msg.hdr.GetCommand();
+        unsigned int nMessageSize = msg.hdr.nMessageSize;
 
-        // Message size
-        unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessage(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
+        // A version or verack handled just before may have changed how the
+        // payload is read.  Only this thread changes nRecvVersion.
+        vMsg.SetVersion(pfrom->nRecvVersion);
 
         // Checksum
-        if (vRecv.GetVersion() >= 209)
+        if (vMsg.GetVersion() >= 209)
         {
-            uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+            uint256 hash = Hash(vMsg.begin(), vMsg.end());
             unsigned int nChecksum = 0;
             memcpy(&nChecksum, &hash, sizeof(nChecksum));
-            if (nChecksum != hdr.nChecksum)
+            if (nChecksum != msg.hdr.nChecksum)
             {
                 printf("ProcessMessage(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-                       strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
+                       strCommand.c_str(), nMessageSize, nChecksum, msg.hdr.nChecksum);
                 continue;
             }
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
-
         // Process message
         bool fRet = false;
         try
@@ -2484,7 +3753,6 @@ bool ProcessMessages(CNode* pfrom)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
     }
 
-    vRecv.Compact();
     return true;
 }
 
@@ -2498,7 +3766,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             return true;
 
         // Keep-alive ping
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty())
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty())
             pto->PushMessage("ping");
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -2588,6 +3856,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         vector<CInv> vInv;
         vector<CInv> vInvWait;
+        bool fBlockInv = false;
         CRITICAL_BLOCK(pto->cs_inventory)
         {
             vInv.reserve(pto->vInventoryToSend.size());
@@ -2628,6 +3897,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 if (pto->setInventoryKnown.insert(inv).second)
                 {
                     vInv.push_back(inv);
+                    if (inv.type == MSG_BLOCK)
+                        fBlockInv = true;
                     if (vInv.size() >= 1000)
                     {
                         pto->PushMessage("inv", vInv);
@@ -2636,6 +3907,15 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 }
             }
             pto->vInventoryToSend = vInvWait;
+
+            // Block invs never trickle, so this is how long the oldest one
+            // waited between being relayed and being announced to this peer
+            if (pto->nBlockInventoryTime != 0)
+            {
+                if (fBlockInv)
+                    RecordBlockRelayDelay(GetTimeMicros() - pto->nBlockInventoryTime);
+                pto->nBlockInventoryTime = 0;
+            }
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -2662,6 +3942,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        blockDownloader.Schedule(pto, vGetData);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
@@ -2779,9 +4060,10 @@ void CBlock::SetNull()
     vtx.clear();
     vMerkleTree.clear();
     auxpow.reset();
+    fHashCached = false;
 }
 
-CBlock* CreateNewBlock(CReserveKey& reservekey)
+CBlock* CreateNewBlock(CReserveKey& reservekey, CBlockTemplate* ptemplate)
 {
     CBlockIndex* pindexPrev = pindexBest;
 
@@ -2802,6 +4084,9 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
 
     // Collect memory pool transactions into the block
     int64 nFees = 0;
+    map<uint256, CTxIndex> mapTestPool;
+    uint64 nBlockSize = 1000;
+    int nBlockSigOps = 100;
     CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(cs_mapTransactions)
     {
@@ -2811,6 +4096,10 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
         multimap<double, CTransaction*> mapPriority;
+
+        // Previous transactions on disk and their depth, read once per assembly
+        map<uint256, CTransaction> mapTxPrev;
+        map<uint256, int> mapTxPrevConf;
         for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
         {
             CTransaction& tx = (*mi).second;
@@ -2822,9 +4111,18 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
             {
                 // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                if (!mapTxPrev.count(txin.prevout.hash))
+                {
+                    CTransaction txPrev;
+                    CTxIndex txindex;
+                    if (txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                    {
+                        mapTxPrev[txin.prevout.hash] = txPrev;
+                        mapTxPrevConf[txin.prevout.hash] = txindex.GetDepthInMainChain();
+                    }
+                }
+                map<uint256, CTransaction>::iterator miPrev = mapTxPrev.find(txin.prevout.hash);
+                if (miPrev == mapTxPrev.end())
                 {
                     // Has to wait for dependencies
                     if (!porphan)
@@ -2837,10 +4135,11 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
                     porphan->setDependsOn.insert(txin.prevout.hash);
                     continue;
                 }
+                const CTransaction& txPrev = (*miPrev).second;
+                if (txin.prevout.n >= txPrev.vout.size())
+                    continue;
                 int64 nValueIn = txPrev.vout[txin.prevout.n].nValue;
-
-                // Read block header
-                int nConf = txindex.GetDepthInMainChain();
+                int nConf = mapTxPrevConf[txin.prevout.hash];
 
                 dPriority += (double)nValueIn * nConf;
 
@@ -2866,9 +4165,6 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
         }
 
         // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64 nBlockSize = 1000;
-        int nBlockSigOps = 100;
         while (!mapPriority.empty())
         {
             // Take highest priority transaction off priority queue
@@ -2888,12 +4184,33 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
             bool fAllowFree = (nBlockSize + nTxSize < 4000 || CTransaction::AllowFree(dPriority));
             int64 nMinFee = tx.GetMinFee(nBlockSize, fAllowFree, true);
 
+            // Remember the test pool entries ConnectInputs may change, so that a
+            // candidate that fails is rolled back in O(inputs) instead of copying
+            // the whole pool for every candidate
+            uint256 hash = tx.GetHash();
+            map<uint256, CTxIndex> mapUndo;
+            set<uint256> setUndoErase;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                map<uint256, CTxIndex>::iterator mi = mapTestPool.find(txin.prevout.hash);
+                if (mi != mapTestPool.end())
+                    mapUndo.insert(*mi);
+                else
+                    setUndoErase.insert(txin.prevout.hash);
+            }
+            if (!mapTestPool.count(hash))
+                setUndoErase.insert(hash);
+
             // Connecting shouldn't fail due to dependency on other memory pool transactions
             // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            if (!tx.ConnectInputs(txdb, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, nFees, false, true, nMinFee))
+            if (!tx.ConnectInputs(txdb, mapTestPool, CDiskTxPos(1,1,1), pindexPrev, nFees, false, true, nMinFee, &mapTxPrev))
+            {
+                for (map<uint256, CTxIndex>::iterator mi = mapUndo.begin(); mi != mapUndo.end(); ++mi)
+                    mapTestPool[(*mi).first] = (*mi).second;
+                BOOST_FOREACH(const uint256& hashErase, setUndoErase)
+                    mapTestPool.erase(hashErase);
                 continue;
-            swap(mapTestPool, mapTestPoolTmp);
+            }
 
             // Added
             pblock->vtx.push_back(tx);
@@ -2901,7 +4218,6 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
             nBlockSigOps += nTxSigOps;
 
             // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
             if (mapDependers.count(hash))
             {
                 BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
@@ -2925,11 +4241,136 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
     pblock->nBits          = GetNextWorkRequired(pindexPrev);
     pblock->nNonce         = 0;
 
+    if (ptemplate)
+    {
+        ptemplate->block = *pblock;
+        ptemplate->pindexPrev = pindexPrev;
+        ptemplate->mapTestPool.swap(mapTestPool);
+        ptemplate->nFees = nFees;
+        ptemplate->nBlockSize = nBlockSize;
+        ptemplate->nBlockSigOps = nBlockSigOps;
+        ptemplate->vCoinbaseBranch = pblock->GetMerkleBranch(0);
+        ptemplate->setInBlock.clear();
+        for (int i = 1; i < pblock->vtx.size(); i++)
+            ptemplate->setInBlock.insert(pblock->vtx[i].GetHash());
+        ptemplate->setRejected.clear();
+    }
+
     return pblock.release();
 }
 
+// Appends the memory pool transactions that are not in the template yet.
+// Returns false if a transaction of the template has left the memory pool,
+// in which case the template has to be assembled again.
+bool CBlockTemplate::AddTransactions(bool& fAdded)
+{
+    fAdded = false;
+    CRITICAL_BLOCK(cs_main)
+    CRITICAL_BLOCK(cs_mapTransactions)
+    {
+        BOOST_FOREACH(const uint256& hash, setInBlock)
+            if (!mapTransactions.count(hash))
+                return false;
+
+        // Only the transactions that arrived since the last call are
+        // candidates, collected with one pass over the pool
+        vector<pair<uint256, CTransaction*> > vCandidates;
+        for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
+        {
+            const uint256& hash = (*mi).first;
+            CTransaction& tx = (*mi).second;
+            if (setInBlock.count(hash) || setRejected.count(hash) || tx.IsCoinBase() || !tx.IsFinal())
+                continue;
+            vCandidates.push_back(make_pair(hash, &tx));
+        }
+
+        // New transactions may depend on each other, so pass over the
+        // candidates until nothing more can be added.  Transactions that
+        // still do not connect are not tried again until the next full
+        // assembly.
+        CTxDB txdb("r");
+        bool fProgress = true;
+        while (fProgress && !vCandidates.empty())
+        {
+            fProgress = false;
+            vector<pair<uint256, CTransaction*> > vFailed;
+            for (int i = 0; i < vCandidates.size(); i++)
+            {
+                const uint256& hash = vCandidates[i].first;
+                CTransaction& tx = *vCandidates[i].second;
+
+                unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK);
+                if (nBlockSize + nTxSize >= MAX_BLOCK_SIZE_GEN)
+                    continue;
+                int nTxSigOps = tx.GetSigOpCount();
+                if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+                    continue;
+
+                // Priority is not computed here, free high priority transactions
+                // wait for the next full assembly
+                int64 nMinFee = tx.GetMinFee(nBlockSize, nBlockSize + nTxSize < 4000, true);
+
+                map<uint256, CTxIndex> mapUndo;
+                set<uint256> setUndoErase;
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                {
+                    map<uint256, CTxIndex>::iterator miPool = mapTestPool.find(txin.prevout.hash);
+                    if (miPool != mapTestPool.end())
+                        mapUndo.insert(*miPool);
+                    else
+                        setUndoErase.insert(txin.prevout.hash);
+                }
+                if (!mapTestPool.count(hash))
+                    setUndoErase.insert(hash);
+
+                if (!tx.ConnectInputs(txdb, mapTestPool, CDiskTxPos(1,1,1), pindexPrev, nFees, false, true, nMinFee))
+                {
+                    for (map<uint256, CTxIndex>::iterator miUndo = mapUndo.begin(); miUndo != mapUndo.end(); ++miUndo)
+                        mapTestPool[(*miUndo).first] = (*miUndo).second;
+                    BOOST_FOREACH(const uint256& hashErase, setUndoErase)
+                        mapTestPool.erase(hashErase);
+                    vFailed.push_back(vCandidates[i]);
+                    continue;
+                }
+
+                block.vtx.push_back(tx);
+                setInBlock.insert(hash);
+                nBlockSize += nTxSize;
+                nBlockSigOps += nTxSigOps;
+                fProgress = true;
+                fAdded = true;
+            }
+            vCandidates.swap(vFailed);
+        }
+        for (int i = 0; i < vCandidates.size(); i++)
+            setRejected.insert(vCandidates[i].first);
+    }
+
+    if (fAdded)
+    {
+        block.vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        vCoinbaseBranch = block.GetMerkleBranch(0);
+    }
+    return true;
+}
+
+
+// With the merkle branch of the coinbase the new merkle root is computed in
+// O(log n) instead of rebuilding the whole tree
+void SetCoinbaseScript(CBlock* pblock, const CScript& scriptSig, const vector<uint256>* pvCoinbaseBranch)
+{
+    pblock->vtx[0].vin[0].scriptSig = scriptSig;
+    if (pvCoinbaseBranch)
+    {
+        pblock->vMerkleTree.clear();
+        pblock->hashMerkleRoot = CBlock::CheckMerkleBranch(pblock->vtx[0].GetHash(), *pvCoinbaseBranch, 0);
+    }
+    else
+        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+}
 
-void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime)
+void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, const vector<uint256>* pvCoinbaseBranch)
 {
     // Update nExtraNonce
     int64 nNow = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
@@ -2938,8 +4379,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
         nExtraNonce = 1;
         nPrevTime = nNow;
     }
-    pblock->vtx[0].vin[0].scriptSig = CScript() << pblock->nBits << CBigNum(nExtraNonce);
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    SetCoinbaseScript(pblock, CScript() << pblock->nBits << CBigNum(nExtraNonce), pvCoinbaseBranch);
 }
 
 // Create coinbase with auxiliary data, for multichain mining
@@ -2992,7 +4432,7 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     uint256 hash = pblock->GetHash();
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     CAuxPow *auxpow = pblock->auxpow.get();
 
@@ -3106,7 +4546,7 @@ void static BitcoinMiner(CWallet *pwallet)
         // Search
         //
         int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
         uint256 hashbuf[2];
         uint256& hash = *alignup<16>(hashbuf);
         loop
@@ -3246,13 +4686,120 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
 bool CBlockIndex::CheckIndex() const
 {
     if (nVersion & BLOCK_VERSION_AUXPOW)
-        return CheckProofOfWork(auxpow->GetParentBlockHash(), nBits);
+    {
+        boost::shared_ptr<CAuxPow> auxpow = GetAuxPow();
+        return auxpow && CheckProofOfWork(auxpow->GetParentBlockHash(), nBits);
+    }
+    else
+        return CheckProofOfWork(GetBlockHash(), nBits);
+}
+
+bool CDiskBlockIndex::CheckIndex() const
+{
+    if (nVersion & BLOCK_VERSION_AUXPOW)
+        return auxpow && CheckProofOfWork(auxpow->GetParentBlockHash(), nBits);
     else
         return CheckProofOfWork(GetBlockHash(), nBits);
 }
 
+//
+// Small LRU cache of the auxpows of recently used block index entries, the
+// rest stay on disk until asked for
+//
+
+static const unsigned int MAX_AUXPOW_CACHE = 1000;
+
+static CCriticalSection cs_mapAuxPowCache;
+static list<const CBlockIndex*> lruAuxPowCache;
+static map<const CBlockIndex*, pair<boost::shared_ptr<CAuxPow>, list<const CBlockIndex*>::iterator> > mapAuxPowCache;
+static uint64 nAuxPowCacheHits = 0;
+static uint64 nAuxPowCacheMisses = 0;
+
+void CacheAuxPow(const CBlockIndex* pindex, const boost::shared_ptr<CAuxPow>& auxpow)
+{
+    if (!auxpow)
+        return;
+    CRITICAL_BLOCK(cs_mapAuxPowCache)
+    {
+        if (mapAuxPowCache.count(pindex))
+            return;
+        lruAuxPowCache.push_front(pindex);
+        mapAuxPowCache[pindex] = make_pair(auxpow, lruAuxPowCache.begin());
+        if (mapAuxPowCache.size() > MAX_AUXPOW_CACHE)
+        {
+            mapAuxPowCache.erase(lruAuxPowCache.back());
+            lruAuxPowCache.pop_back();
+        }
+    }
+}
+
+void GetAuxPowCacheStats(int& nEntries, uint64& nHits, uint64& nMisses)
+{
+    CRITICAL_BLOCK(cs_mapAuxPowCache)
+    {
+        nEntries = mapAuxPowCache.size();
+        nHits = nAuxPowCacheHits;
+        nMisses = nAuxPowCacheMisses;
+    }
+}
+
+boost::shared_ptr<CAuxPow> CBlockIndex::GetAuxPow(bool fCache) const
+{
+    if (!(nVersion & BLOCK_VERSION_AUXPOW))
+        return boost::shared_ptr<CAuxPow>();
+
+    CRITICAL_BLOCK(cs_mapAuxPowCache)
+    {
+        map<const CBlockIndex*, pair<boost::shared_ptr<CAuxPow>, list<const CBlockIndex*>::iterator> >::iterator mi = mapAuxPowCache.find(this);
+        if (mi != mapAuxPowCache.end())
+        {
+            nAuxPowCacheHits++;
+            lruAuxPowCache.splice(lruAuxPowCache.begin(), lruAuxPowCache, (*mi).second.second);
+            return (*mi).second.first;
+        }
+        nAuxPowCacheMisses++;
+    }
+
+    // The block header on disk carries the auxpow
+    CBlock block;
+    try
+    {
+        if (!block.ReadFromDisk(nFile, nBlockPos, false))
+            block.auxpow.reset();
+    }
+    catch (std::exception& e)
+    {
+        // Truncated or corrupt block file
+        block.auxpow.reset();
+    }
+    if (!block.auxpow)
+    {
+        error("CBlockIndex::GetAuxPow() : reading auxpow of block %d failed", nHeight);
+        return boost::shared_ptr<CAuxPow>();
+    }
+
+    // Bulk readers like getheaders pass fCache=false so they don't push
+    // the recently used entries out
+    if (fCache)
+        CacheAuxPow(this, block.auxpow);
+    return block.auxpow;
+}
+
+boost::shared_ptr<CAuxPow> CBlockIndex::GetCachedAuxPow() const
+{
+    // Peek only, never touches the disk or the LRU order
+    CRITICAL_BLOCK(cs_mapAuxPowCache)
+    {
+        map<const CBlockIndex*, pair<boost::shared_ptr<CAuxPow>, list<const CBlockIndex*>::iterator> >::iterator mi = mapAuxPowCache.find(this);
+        if (mi != mapAuxPowCache.end())
+            return (*mi).second.first;
+    }
+    return boost::shared_ptr<CAuxPow>();
+}
+
 std::string CBlockIndex::ToString() const
 {
+    boost::shared_ptr<CAuxPow> auxpow = GetCachedAuxPow();
     return strprintf("CBlockIndex(nprev=%08x, pnext=%08x, nFile=%d, nBlockPos=%-6d nHeight=%d, merkle=%s, hashBlock=%s, hashParentBlock=%s)",
             pprev, pnext, nFile, nBlockPos, nHeight,
             hashMerkleRoot.ToString().substr(0,10).c_str(),
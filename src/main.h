@@ -15,6 +15,9 @@
 
 class CBlock;
 class CBlockIndex;
+class CBlockTemplate;
+class CSignatureCheck;
+class CBlockFileMapping;
 class CWalletTx;
 class CWallet;
 class CKeyItem;
@@ -34,6 +37,8 @@ class CAuxPow;
 static const unsigned int MAX_BLOCK_SIZE = 1000000;
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
+static const uint64 DEFAULT_MAX_ORPHAN_BLOCKS_SIZE = 40 * 1000000;
+static const uint64 DEFAULT_MAX_ORPHAN_TX_SIZE = 5 * 1000000;
 static const int64 COIN = 100000000;
 static const int64 CENT = 1000000;
 static const int64 MIN_TX_FEE = 500000;
@@ -52,20 +57,72 @@ static const int fHaveUPnP = false;
 
 
 
+// Hashes of blocks we index carry proof of work, which makes their low 64
+// bits too expensive to grind, so they are used as the bucket hash as is.
+// Only for maps whose keys are such block hashes.
+class CUint256Hasher
+{
+public:
+    size_t operator()(const uint256& hash) const
+    {
+        return (size_t)hash.GetLow64();
+    }
+};
+
+// For keys a peer chooses freely, like the hashes of orphan transactions
+// and the prevouts they spend: all of the key is mixed with a random
+// per-map salt, so nobody can line up entries in one bucket
+class CSaltedUint256Hasher
+{
+private:
+    uint64 k0, k1;
+
+    static uint64 Mix(uint64 n)
+    {
+        n ^= n >> 33;
+        n *= 0xff51afd7ed558ccdULL;
+        n ^= n >> 33;
+        n *= 0xc4ceb9fe1a85ec53ULL;
+        n ^= n >> 33;
+        return n;
+    }
+
+public:
+    CSaltedUint256Hasher()
+    {
+        RAND_bytes((unsigned char*)&k0, sizeof(k0));
+        RAND_bytes((unsigned char*)&k1, sizeof(k1));
+    }
+
+    size_t operator()(const uint256& hash) const
+    {
+        uint64 pn[4];
+        memcpy(pn, &hash, sizeof(pn));
+        uint64 n = k0;
+        for (int i = 0; i < 4; i++)
+            n = Mix(n ^ pn[i]) + k1;
+        return (size_t)n;
+    }
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, CUint256Hasher> BlockMap;
+
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern uint256 hashGenesisBlock;
-extern CBigNum bnProofOfWorkLimit;
+extern uint256 nProofOfWorkLimit;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
-extern CBigNum bnBestChainWork;
-extern CBigNum bnBestInvalidWork;
+extern uint256 nBestChainWork;
+extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+extern std::vector<CBlockIndex*> vActiveChain;
 extern unsigned int nTransactionsUpdated;
 extern double dHashesPerSec;
 extern int64 nHPSTimerStart;
 extern int64 nTimeBestReceived;
+extern int nSignatureCheckThreads;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
 
@@ -92,21 +149,38 @@ void UnregisterWallet(CWallet* pwalletIn);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
+boost::shared_ptr<CBlockFileMapping> MapBlockFile(unsigned int nFile, unsigned int nBlockPos);
+void UnmapBlockFile(unsigned int nFile);
+CBlockIndex* InsertBlockIndex(const uint256& hash);
+void ReserveBlockIndex(unsigned int nCount);
+void GetBlockIndexArenaStats(int& nChunks, uint64& nBytes);
+void AddBlockIndexPos(CBlockIndex* pindex);
+void SetOrphanPoolLimits(uint64 nMaxBlocksSize, uint64 nMaxTxSize);
+CBlockIndex* GetBlockIndexAtPos(unsigned int nFile, unsigned int nBlockPos);
+int GetAncestorDepth(CBlockIndex* pindexBlock, const CDiskTxPos& pos, int nMaxDepth);
+void SetActiveChainTip(CBlockIndex* pindexTip);
+CBlockIndex* GetActiveChainBlock(int nHeight);
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
+bool LoadBlockIndexSnapshot(CTxDB& txdb);
+bool WriteBlockIndexSnapshot(bool fAsync=false);
 void PrintBlockTree();
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
-CBlock* CreateNewBlock(CReserveKey& reservekey);
-void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime);
-void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, std::vector<unsigned char>& vchAux);
+CBlock* CreateNewBlock(CReserveKey& reservekey, CBlockTemplate* ptemplate=NULL);
+void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, const std::vector<uint256>* pvCoinbaseBranch=NULL);
+void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, std::vector<unsigned char>& vchAux, const std::vector<uint256>* pvCoinbaseBranch=NULL);
+void SetCoinbaseScript(CBlock* pblock, const CScript& scriptSig, const std::vector<uint256>* pvCoinbaseBranch=NULL);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 int GetTotalBlocksEstimate();
 bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
+void StartSignatureCheckThreads(int nThreads);
+void StopSignatureCheckThreads();
+bool VerifySignatureChecks(const std::vector<CSignatureCheck>& vChecks);
 
 
 
@@ -119,8 +193,27 @@ std::string GetWarnings(std::string strFor);
 
 
 
+void CacheAuxPow(const CBlockIndex* pindex, const boost::shared_ptr<CAuxPow>& auxpow);
+void GetAuxPowCacheStats(int& nEntries, uint64& nHits, uint64& nMisses);
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+// Transaction and block hash counts for the ConnectBlock benchmark output.
+// Each thread has its own, and they only count while -benchmark is set.
+class CHashCounters
+{
+public:
+    uint64 nComputed;
+    uint64 nCacheHits;
+
+    CHashCounters()
+    {
+        nComputed = 0;
+        nCacheHits = 0;
+    }
+};
+
+CHashCounters& GetHashCounters();
+
 template<typename T>
 bool WriteSetting(const std::string& strKey, const T& value)
 {
@@ -419,6 +512,38 @@ public:
 
 
 
+//
+// A read-only mapping of a block file.  Readers hold a reference while they
+// deserialize, so a mapping replaced by MapBlockFile (the file grew) or
+// evicted from its cache stays valid until the last reader is done.
+//
+class CBlockFileMapping
+{
+protected:
+    const char* pbegin;
+    unsigned int nSize;
+
+public:
+    CBlockFileMapping(const char* pbeginIn, unsigned int nSizeIn)
+    {
+        pbegin = pbeginIn;
+        nSize = nSizeIn;
+    }
+
+    ~CBlockFileMapping();
+
+    const char* Begin() const { return pbegin; }
+    const char* End() const { return pbegin + nSize; }
+    unsigned int GetSize() const { return nSize; }
+
+private:
+    CBlockFileMapping(const CBlockFileMapping&);
+    void operator=(const CBlockFileMapping&);
+};
+
+
+
+
 //
 // The basic transaction that is broadcasted on the network and contained in
 // blocks.  A transaction can contain multiple inputs and outputs.
@@ -431,12 +556,35 @@ public:
     std::vector<CTxOut> vout;
     unsigned int nLockTime;
 
+    // memory only
+    // The hash is memoized only for deserialized transactions, which are never
+    // modified afterwards.  It is computed while deserializing, before any
+    // other thread can see the object, so GetHash() only reads it.  Copies may
+    // be modified and don't keep it.
+    mutable bool fHashCached;
+    mutable uint256 hashCached;
+
 
     CTransaction()
     {
         SetNull();
     }
 
+    CTransaction(const CTransaction& tx)
+    {
+        *this = tx;
+    }
+
+    CTransaction& operator=(const CTransaction& tx)
+    {
+        nVersion = tx.nVersion;
+        vin = tx.vin;
+        vout = tx.vout;
+        nLockTime = tx.nLockTime;
+        fHashCached = false;
+        return *this;
+    }
+
     IMPLEMENT_SERIALIZE
     (
         READWRITE(this->nVersion);
@@ -444,6 +592,13 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+        {
+            if (fBenchmark)
+                GetHashCounters().nComputed++;
+            hashCached = SerializeHash(*this);
+            fHashCached = true;
+        }
     )
 
     void SetNull()
@@ -452,6 +607,7 @@ public:
         vin.clear();
         vout.clear();
         nLockTime = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -461,6 +617,14 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+        {
+            if (fBenchmark)
+                GetHashCounters().nCacheHits++;
+            return hashCached;
+        }
+        if (fBenchmark)
+            GetHashCounters().nComputed++;
         return SerializeHash(*this);
     }
 
@@ -601,6 +765,18 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            // Read transaction straight out of the mapped block file
+            boost::shared_ptr<CBlockFileMapping> mapping = MapBlockFile(pos.nFile, pos.nTxPos);
+            if (mapping)
+            {
+                CMemoryStream filein(mapping->Begin() + pos.nTxPos, mapping->End(), SER_DISK);
+                filein >> *this;
+                return true;
+            }
+        }
+
         CAutoFile filein = OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb");
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -661,7 +837,9 @@ public:
     bool ReadFromDisk(COutPoint prevout);
     bool DisconnectInputs(CTxDB& txdb, CBlockIndex* pindex);
     bool ConnectInputs(CTxDB& txdb, std::map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx,
-                       CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0);
+                       CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0,
+                       std::map<uint256, CTransaction>* pmapTxPrev=NULL,
+                       std::vector<CSignatureCheck>* pvChecks=NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -674,6 +852,37 @@ public:
 
 
 
+//
+// An input signature check deferred by ConnectInputs, so the checks of a
+// whole block can be run together on the signature check threads
+//
+class CSignatureCheck
+{
+public:
+    CScript scriptPubKey;
+    const CTransaction* ptxTo;
+    unsigned int nIn;
+
+    CSignatureCheck()
+    {
+        ptxTo = NULL;
+        nIn = 0;
+    }
+
+    CSignatureCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn)
+    {
+        scriptPubKey = scriptPubKeyIn;
+        ptxTo = &txToIn;
+        nIn = nInIn;
+    }
+
+    bool Verify() const
+    {
+        return VerifyScript(ptxTo->vin[nIn].scriptSig, scriptPubKey, *ptxTo, nIn, 0);
+    }
+};
+
+
 
 
 //
@@ -838,6 +1047,9 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    // Hash memoized for deserialized blocks only, see CTransaction
+    mutable bool fHashCached;
+    mutable uint256 hashCached;
 
 
     CBlock()
@@ -845,6 +1057,26 @@ public:
         SetNull();
     }
 
+    CBlock(const CBlock& block)
+    {
+        *this = block;
+    }
+
+    CBlock& operator=(const CBlock& block)
+    {
+        nVersion = block.nVersion;
+        hashPrevBlock = block.hashPrevBlock;
+        hashMerkleRoot = block.hashMerkleRoot;
+        nTime = block.nTime;
+        nBits = block.nBits;
+        nNonce = block.nNonce;
+        vtx = block.vtx;
+        auxpow = block.auxpow;
+        vMerkleTree = block.vMerkleTree;
+        fHashCached = false;
+        return *this;
+    }
+
     IMPLEMENT_SERIALIZE
     (
         READWRITE(this->nVersion);
@@ -862,6 +1094,14 @@ public:
             READWRITE(vtx);
         else if (fRead)
             const_cast<CBlock*>(this)->vtx.clear();
+
+        if (fRead)
+        {
+            if (fBenchmark)
+                GetHashCounters().nComputed++;
+            hashCached = Hash(BEGIN(nVersion), END(nNonce));
+            fHashCached = true;
+        }
     )
 
     int GetChainID() const
@@ -880,6 +1120,14 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+        {
+            if (fBenchmark)
+                GetHashCounters().nCacheHits++;
+            return hashCached;
+        }
+        if (fBenchmark)
+            GetHashCounters().nComputed++;
         return Hash(BEGIN(nVersion), END(nNonce));
     }
 
@@ -967,6 +1215,7 @@ public:
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
+        UnmapBlockFile(nFileRet);
         if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
         {
 #ifdef __WXMSW__
@@ -985,15 +1234,27 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = OpenBlockFile(nFile, nBlockPos, "rb");
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
-        filein >> *this;
+        boost::shared_ptr<CBlockFileMapping> mapping = MapBlockFile(nFile, nBlockPos);
+        if (mapping)
+        {
+            // Read block straight out of the mapped block file
+            CMemoryStream filein(mapping->Begin() + nBlockPos, mapping->End(), SER_DISK);
+            if (!fReadTransactions)
+                filein.nType |= SER_BLOCKHEADERONLY;
+            filein >> *this;
+        }
+        else
+        {
+            // Open history file to read
+            CAutoFile filein = OpenBlockFile(nFile, nBlockPos, "rb");
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+            if (!fReadTransactions)
+                filein.nType |= SER_BLOCKHEADERONLY;
+
+            // Read block
+            filein >> *this;
+        }
 
         // Check the header
         if (!CheckProofOfWork(INT_MAX))
@@ -1040,6 +1301,41 @@ public:
 
 
 
+//
+// Block assembled from the memory pool for the mining RPCs, together with the
+// test pool of its transactions, so that transactions arriving later can be
+// appended without assembling the block again.  The merkle branch of the
+// coinbase lets the RPCs hand out new extranonces in O(log n).
+//
+class CBlockTemplate
+{
+public:
+    CBlock block;
+    CBlockIndex* pindexPrev;
+    std::map<uint256, CTxIndex> mapTestPool;
+    int64 nFees;
+    uint64 nBlockSize;
+    int nBlockSigOps;
+    std::vector<uint256> vCoinbaseBranch;
+    std::set<uint256> setInBlock;
+    std::set<uint256> setRejected;
+    unsigned int nSerial;
+
+    CBlockTemplate()
+    {
+        pindexPrev = NULL;
+        nFees = 0;
+        nBlockSize = 0;
+        nBlockSigOps = 0;
+        nSerial = 0;
+    }
+
+    bool AddTransactions(bool& fAdded);
+};
+
+
+
+
 //
 // The block chain is a tree shaped structure starting with the
 // genesis block at the root, with each block potentially having multiple
@@ -1054,10 +1350,11 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip;
     unsigned int nFile;
     unsigned int nBlockPos;
     int nHeight;
-    CBigNum bnChainWork;
+    uint256 nChainWork;
 
     // block header
     int nVersion;
@@ -1066,8 +1363,8 @@ public:
     unsigned int nBits;
     unsigned int nNonce;
 
-    // if this is an aux work block
-    boost::shared_ptr<CAuxPow> auxpow;
+    // The auxpow of aux work blocks is not kept here, GetAuxPow reads it
+    // from the block file at nFile, nBlockPos
 
 
     CBlockIndex()
@@ -1075,17 +1372,17 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
-        bnChainWork = 0;
+        nChainWork = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
         nTime          = 0;
         nBits          = 0;
         nNonce         = 0;
-        auxpow.reset();
     }
 
     CBlockIndex(unsigned int nFileIn, unsigned int nBlockPosIn, CBlock& block)
@@ -1093,20 +1390,23 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
-        bnChainWork = 0;
+        nChainWork = 0;
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
         nTime          = block.nTime;
         nBits          = block.nBits;
         nNonce         = block.nNonce;
-        auxpow         = block.auxpow;
     }
 
-    CBlock GetBlockHeader() const
+    boost::shared_ptr<CAuxPow> GetAuxPow(bool fCache=true) const;
+    boost::shared_ptr<CAuxPow> GetCachedAuxPow() const;
+
+    CBlock GetBlockHeader(bool fCacheAuxPow=true) const
     {
         CBlock block;
         block.nVersion       = nVersion;
@@ -1116,7 +1416,7 @@ public:
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nNonce         = nNonce;
-        block.auxpow         = auxpow;
+        block.auxpow         = GetAuxPow(fCacheAuxPow);
         return block;
     }
 
@@ -1130,13 +1430,17 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        bool fNegative;
+        bool fOverflow;
+        uint256 nTarget;
+        nTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || nTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // 2**256 / (nTarget+1) doesn't fit in 256 bits, but since
+        // 2**256 >= nTarget+1 it equals ~nTarget / (nTarget+1) + 1
+        return (~nTarget / (nTarget + 1)) + 1;
     }
 
     bool IsInMainChain() const
@@ -1146,6 +1450,12 @@ public:
 
     bool CheckIndex() const;
 
+    // pskip points to an ancestor further back, so GetAncestor only needs
+    // O(log n) steps.  BuildSkip must be called once pprev and nHeight are
+    // set and the ancestors have their skip pointers.
+    void BuildSkip();
+    CBlockIndex* GetAncestor(int nAncestorHeight);
+
     bool EraseBlockFromDisk()
     {
         // Open history file
@@ -1210,6 +1520,9 @@ public:
     uint256 hashPrev;
     uint256 hashNext;
 
+    // if this is an aux work block
+    boost::shared_ptr<CAuxPow> auxpow;
+
     CDiskBlockIndex()
     {
         hashPrev = 0;
@@ -1220,6 +1533,7 @@ public:
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
         hashNext = (pnext ? pnext->GetBlockHash() : 0);
+        auxpow = pindex->GetAuxPow();
     }
 
     IMPLEMENT_SERIALIZE
@@ -1255,6 +1569,8 @@ public:
         return block.GetHash();
     }
 
+    bool CheckIndex() const;
+
 
     std::string ToString() const
     {
@@ -1302,7 +1618,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1324,6 +1640,12 @@ public:
         return vHave.empty();
     }
 
+    // Have the peer start from a block it announced that we don't have yet
+    void Prepend(const uint256& hash)
+    {
+        vHave.insert(vHave.begin(), hash);
+    }
+
     void Set(const CBlockIndex* pindex)
     {
         vHave.clear();
@@ -1348,7 +1670,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1367,7 +1689,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1383,7 +1705,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1602,6 +1924,220 @@ public:
 
 
 
+class COrphanPoolStats
+{
+public:
+    int nCount;
+    uint64 nSize;
+    uint64 nMaxSize;
+    int nPeers;
+    uint64 nEvicted;
+    uint64 nRejected;
+};
+
+void GetOrphanPoolStats(COrphanPoolStats& blocks, COrphanPoolStats& transactions);
+
+//
+// Holding area for blocks and transactions whose parents we don't have yet.
+// The pool owns its items and is capped both in total size and in the size
+// any single peer may fill.  When a cap is hit the oldest orphans, of that
+// peer or of the whole pool, are evicted.  Dependents of a hash are found
+// with a single hash lookup.
+//
+template<typename T>
+class COrphanPool
+{
+protected:
+    class CEntry
+    {
+    public:
+        T* pitem;
+        std::vector<uint256> vPrev;
+        unsigned int nSize;
+        unsigned int nPeer;
+        std::list<uint256>::iterator itAge;
+        std::list<uint256>::iterator itPeerAge;
+    };
+
+    class CPeer
+    {
+    public:
+        uint64 nSize;
+        std::list<uint256> lAge;
+        CPeer() { nSize = 0; }
+    };
+
+    boost::unordered_map<uint256, CEntry, CSaltedUint256Hasher> mapEntries;
+    boost::unordered_map<uint256, std::vector<uint256>, CSaltedUint256Hasher> mapByPrev;
+    std::map<unsigned int, CPeer> mapPeers;
+    std::list<uint256> lAge;
+    uint64 nTotalSize;
+    uint64 nMaxSize;
+    uint64 nMaxPeerSize;
+    uint64 nEvicted;
+    uint64 nRejected;
+
+public:
+    COrphanPool(uint64 nMaxSizeIn, uint64 nMaxPeerSizeIn)
+    {
+        nTotalSize = 0;
+        nMaxSize = nMaxSizeIn;
+        nMaxPeerSize = nMaxPeerSizeIn;
+        nEvicted = 0;
+        nRejected = 0;
+    }
+
+    ~COrphanPool()
+    {
+        while (!lAge.empty())
+            Erase(lAge.front());
+    }
+
+    void SetLimits(uint64 nMaxSizeIn, uint64 nMaxPeerSizeIn)
+    {
+        nMaxSize = nMaxSizeIn;
+        nMaxPeerSize = nMaxPeerSizeIn;
+        while (nTotalSize > nMaxSize && !lAge.empty())
+        {
+            Erase(lAge.front());
+            nEvicted++;
+        }
+    }
+
+    // Takes ownership of pitem.  Returns false, and deletes pitem, if the
+    // hash is already held or the item is larger than the peer's share.
+    bool Add(const uint256& hash, T* pitem, const std::vector<uint256>& vPrev, unsigned int nSize, unsigned int nPeer)
+    {
+        if (mapEntries.count(hash) || nSize > nMaxSize || nSize > nMaxPeerSize)
+        {
+            delete pitem;
+            nRejected++;
+            return false;
+        }
+
+        // Make room, first out of the peer's own share, then out of the pool
+        typename std::map<unsigned int, CPeer>::iterator mi;
+        while ((mi = mapPeers.find(nPeer)) != mapPeers.end() && (*mi).second.nSize + nSize > nMaxPeerSize)
+        {
+            Erase((*mi).second.lAge.front());
+            nEvicted++;
+        }
+        while (nTotalSize + nSize > nMaxSize && !lAge.empty())
+        {
+            Erase(lAge.front());
+            nEvicted++;
+        }
+
+        CEntry& entry = mapEntries[hash];
+        entry.pitem = pitem;
+        entry.vPrev = vPrev;
+        entry.nSize = nSize;
+        entry.nPeer = nPeer;
+        entry.itAge = lAge.insert(lAge.end(), hash);
+        CPeer& peer = mapPeers[nPeer];
+        entry.itPeerAge = peer.lAge.insert(peer.lAge.end(), hash);
+        peer.nSize += nSize;
+        for (int i = 0; i < vPrev.size(); i++)
+        {
+            std::vector<uint256>& vDependents = mapByPrev[vPrev[i]];
+            if (std::find(vDependents.begin(), vDependents.end(), hash) == vDependents.end())
+                vDependents.push_back(hash);
+        }
+        nTotalSize += nSize;
+        return true;
+    }
+
+    void Erase(const uint256& hash)
+    {
+        typename boost::unordered_map<uint256, CEntry, CSaltedUint256Hasher>::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end())
+            return;
+        CEntry& entry = (*mi).second;
+        for (int i = 0; i < entry.vPrev.size(); i++)
+        {
+            typename boost::unordered_map<uint256, std::vector<uint256>, CSaltedUint256Hasher>::iterator miPrev = mapByPrev.find(entry.vPrev[i]);
+            if (miPrev == mapByPrev.end())
+                continue;
+            std::vector<uint256>& vDependents = (*miPrev).second;
+            vDependents.erase(std::remove(vDependents.begin(), vDependents.end(), hash), vDependents.end());
+            if (vDependents.empty())
+                mapByPrev.erase(miPrev);
+        }
+        CPeer& peer = mapPeers[entry.nPeer];
+        peer.nSize -= entry.nSize;
+        peer.lAge.erase(entry.itPeerAge);
+        if (peer.lAge.empty())
+            mapPeers.erase(entry.nPeer);
+        nTotalSize -= entry.nSize;
+        lAge.erase(entry.itAge);
+        delete entry.pitem;
+        mapEntries.erase(mi);
+    }
+
+    bool count(const uint256& hash) const
+    {
+        return mapEntries.count(hash);
+    }
+
+    T* Get(const uint256& hash) const
+    {
+        typename boost::unordered_map<uint256, CEntry, CSaltedUint256Hasher>::const_iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end())
+            return NULL;
+        return (*mi).second.pitem;
+    }
+
+    // Copy, since the caller is likely to erase entries while walking them
+    std::vector<uint256> GetDependents(const uint256& hashPrev) const
+    {
+        typename boost::unordered_map<uint256, std::vector<uint256>, CSaltedUint256Hasher>::const_iterator mi = mapByPrev.find(hashPrev);
+        if (mi == mapByPrev.end())
+            return std::vector<uint256>();
+        return (*mi).second;
+    }
+
+    uint64 GetPeerSize(unsigned int nPeer) const
+    {
+        typename std::map<unsigned int, CPeer>::const_iterator mi = mapPeers.find(nPeer);
+        return (mi != mapPeers.end() ? (*mi).second.nSize : 0);
+    }
+
+    int size() const { return mapEntries.size(); }
+    uint64 GetTotalSize() const { return nTotalSize; }
+    uint64 GetMaxSize() const { return nMaxSize; }
+    uint64 GetMaxPeerSize() const { return nMaxPeerSize; }
+
+    void GetStats(COrphanPoolStats& stats) const
+    {
+        stats.nCount = mapEntries.size();
+        stats.nSize = nTotalSize;
+        stats.nMaxSize = nMaxSize;
+        stats.nPeers = mapPeers.size();
+        stats.nEvicted = nEvicted;
+        stats.nRejected = nRejected;
+    }
+};
+
+
+
+
+class CBlockDownloadPeerStats
+{
+public:
+    std::string strAddr;
+    int nInFlight;
+    int nMaxInFlight;
+    uint64 nReceived;
+    int64 nAvgResponse;
+    int nStalls;
+};
+
+void GetBlockDownloadStats(unsigned int& nQueued, unsigned int& nInFlight, uint64& nRerequested, std::vector<CBlockDownloadPeerStats>& vPeers);
+
+
+
+
+
 
 
 
@@ -37,6 +37,7 @@ static const int OP_NAME_NOP = 0x04;
 static const int MIN_FIRSTUPDATE_DEPTH = 12;
 
 map<vector<unsigned char>, uint256> mapMyNames;
+bool fNameValueIndex = false;
 map<vector<unsigned char>, set<uint256> > mapNamePending;
 extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
@@ -50,7 +51,7 @@ extern bool GetValueOfNameTx(const CTransaction& tx, vector<unsigned char>& valu
 extern bool IsConflictedTx(CTxDB& txdb, const CTransaction& tx, vector<unsigned char>& name);
 extern bool GetNameOfTx(const CTransaction& tx, vector<unsigned char>& name);
 bool DecodeNameTx(const CTransaction& tx, int& op, int& nOut, vector<vector<unsigned char> >& vvch);
-extern void rescanfornames();
+extern bool rescanfornames();
 extern Value sendtoaddress(const Array& params, bool fHelp);
 
 const int NAME_COIN_GENESIS_EXTRA = 521;
@@ -76,6 +77,7 @@ public:
             CBlockIndex* pindexBlock);
     virtual bool ConnectBlock(CBlock& block, CTxDB& txdb, CBlockIndex* pindex);
     virtual bool DisconnectBlock(CBlock& block, CTxDB& txdb, CBlockIndex* pindex);
+    virtual void AbortBlockTxn();
     virtual bool ExtractAddress(const CScript& script, string& address);
     virtual bool GenesisBlock(CBlock& block);
     virtual bool Lockin(int nHeight, uint256 hash);
@@ -168,6 +170,12 @@ int GetDisplayExpirationDepth(int nHeight) {
     return 36000;
 }
 
+// Height at which the latest entry of a name expires, for display purposes
+int GetNameExpiryHeight(const CNameIndex& txPos)
+{
+    return txPos.nHeight + GetDisplayExpirationDepth(txPos.nHeight);
+}
+
 int64 GetNetworkFee(int nHeight)
 {
     // Speed up network fee decrease 4x starting at 24000
@@ -190,15 +198,8 @@ int GetTxPosHeight(const CNameIndex& txPos)
 
 int GetTxPosHeight(const CDiskTxPos& txPos)
 {
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txPos.nFile, txPos.nBlockPos, false))
-        return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
+    CBlockIndex* pindex = GetBlockIndexAtPos(txPos.nFile, txPos.nBlockPos);
     if (!pindex || !pindex->IsInMainChain())
         return 0;
     return pindex->nHeight;
@@ -210,21 +211,206 @@ int GetTxPosHeight2(const CDiskTxPos& txPos, int nHeight)
 }
 
 
-int GetNameHeight(CTxDB& txdb, vector<unsigned char> vchName) {
-    CNameDB dbName("cr", txdb);
-    //vector<CDiskTxPos> vtxPos;
+CNameCache nameCache;
+
+void CNameCache::Store(const vector<unsigned char>& vchName, const CNameIndex* ptxPos)
+{
+    map<vector<unsigned char>, CEntry>::iterator mi = mapEntries.find(vchName);
+    if (mi == mapEntries.end())
+    {
+        if (nMaxSize == 0)
+            return;
+        while (mapEntries.size() >= nMaxSize)
+        {
+            mapEntries.erase(lstLRU.back());
+            lstLRU.pop_back();
+        }
+        lstLRU.push_front(vchName);
+        mi = mapEntries.insert(make_pair(vchName, CEntry())).first;
+        mi->second.itLRU = lstLRU.begin();
+    }
+    else
+        lstLRU.splice(lstLRU.begin(), lstLRU, mi->second.itLRU);
+
+    CEntry& entry = mi->second;
+    entry.fExists = (ptxPos != NULL);
+    entry.txPos = ptxPos ? *ptxPos : CNameIndex();
+}
+
+bool CNameCache::Get(const vector<unsigned char>& vchName, CNameIndex& txPos, bool& fExists)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<vector<unsigned char>, CEntry>::iterator mi = mapEntries.find(vchName);
+        if (mi == mapEntries.end())
+        {
+            nMisses++;
+            return false;
+        }
+        nHits++;
+        lstLRU.splice(lstLRU.begin(), lstLRU, mi->second.itLRU);
+        fExists = mi->second.fExists;
+        if (fExists)
+            txPos = mi->second.txPos;
+    }
+    return true;
+}
+
+void CNameCache::Put(const vector<unsigned char>& vchName, const CNameIndex* ptxPos)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        nWriteCount++;
+        Store(vchName, ptxPos);
+    }
+}
+
+void CNameCache::Fill(const vector<unsigned char>& vchName, const CNameIndex* ptxPos, unsigned int nWriteCountStart)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        if (nWriteCount == nWriteCountStart)
+            Store(vchName, ptxPos);
+    }
+}
+
+void CNameCache::Clear()
+{
+    CRITICAL_BLOCK(cs)
+    {
+        nWriteCount++;
+        mapEntries.clear();
+        lstLRU.clear();
+    }
+}
+
+void CNameCache::SetMaxSize(unsigned int nSize)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        nMaxSize = nSize;
+        while (mapEntries.size() > nMaxSize)
+        {
+            mapEntries.erase(lstLRU.back());
+            lstLRU.pop_back();
+        }
+    }
+}
+
+void CNameCache::GetStats(unsigned int& nSize, unsigned int& nMaxSizeRet, uint64& nHitsRet, uint64& nMissesRet) const
+{
+    CRITICAL_BLOCK(cs)
+    {
+        nSize = mapEntries.size();
+        nMaxSizeRet = nMaxSize;
+        nHitsRet = nHits;
+        nMissesRet = nMisses;
+    }
+}
+
+// Name index changes of the block being connected or disconnected.  Each touched
+// name maps to its full, updated history vector; the batch is written into the
+// block's txdb transaction by the ConnectBlock/DisconnectBlock hooks, and thrown
+// away if that transaction is aborted.  Protected by cs_main.
+static map<vector<unsigned char>, vector<CNameIndex> > mapNameBatch;
+// Latest entry of each touched name before the batch, for the secondary indexes
+static map<vector<unsigned char>, CNameIndex> mapNameBatchPrev;
+
+bool GetNameBatchEntry(CTxDB& txdb, const vector<unsigned char>& vchName, vector<CNameIndex>*& pvtxPos)
+{
+    map<vector<unsigned char>, vector<CNameIndex> >::iterator mi = mapNameBatch.find(vchName);
+    if (mi == mapNameBatch.end())
+    {
+        vector<CNameIndex> vtxPos;
+        vector<unsigned char> vchKey = vchName;
+        CNameDB dbName("cr", txdb);
+        if (dbName.ExistsName(vchKey) && !dbName.ReadName(vchKey, vtxPos))
+            return error("GetNameBatchEntry() : failed to read from name DB");
+        if (!vtxPos.empty())
+            mapNameBatchPrev[vchName] = vtxPos.back();
+        mi = mapNameBatch.insert(make_pair(vchName, vtxPos)).first;
+    }
+    pvtxPos = &mi->second;
+    return true;
+}
+
+bool FlushNameBatch(CTxDB& txdb)
+{
+    if (mapNameBatch.empty())
+        return true;
+
+    // No nested transaction: the writes go straight into the block's transaction
+    CNameDB dbName("cr+", txdb);
+    for (map<vector<unsigned char>, vector<CNameIndex> >::iterator mi = mapNameBatch.begin(); mi != mapNameBatch.end(); ++mi)
+    {
+        vector<unsigned char> vchName = mi->first;
+        map<vector<unsigned char>, CNameIndex>::iterator miPrev = mapNameBatchPrev.find(vchName);
+        const CNameIndex* ptxPosOld = (miPrev != mapNameBatchPrev.end() ? &miPrev->second : NULL);
+        const CNameIndex* ptxPosNew = (mi->second.empty() ? NULL : &mi->second.back());
+        if (!dbName.WriteName(vchName, mi->second)
+            || !dbName.UpdateSecondaryIndexes(vchName, ptxPosOld, ptxPosNew))
+        {
+            mapNameBatch.clear();
+            mapNameBatchPrev.clear();
+            return error("FlushNameBatch() : failed to write to name DB");
+        }
+    }
+    mapNameBatch.clear();
+    mapNameBatchPrev.clear();
+    return true;
+}
+
+// Latest index entry of a name, from the cache if possible.  Pass the txdb when
+// called inside a block transaction so that uncommitted writes are seen.
+bool ReadLastNameIndex(const vector<unsigned char>& vchName, CNameIndex& txPos, CTxDB* ptxdb = NULL)
+{
+    if (ptxdb)
+    {
+        map<vector<unsigned char>, vector<CNameIndex> >::iterator mi = mapNameBatch.find(vchName);
+        if (mi != mapNameBatch.end())
+        {
+            if (mi->second.empty())
+                return false;
+            txPos = mi->second.back();
+            return true;
+        }
+    }
+
+    bool fExists;
+    if (nameCache.Get(vchName, txPos, fExists))
+        return fExists;
+
+    unsigned int nWriteCountStart = nameCache.GetWriteCount();
+    vector<unsigned char> vchKey = vchName;
     vector<CNameIndex> vtxPos;
-    if (dbName.ExistsName(vchName))
+    if (ptxdb)
     {
-        if (!dbName.ReadName(vchName, vtxPos))
-            return error("GetNameHeight() : failed to read from name DB");
-        if (vtxPos.empty())
-            return -1;
-        //CDiskTxPos& txPos = vtxPos.back();
-        CNameIndex& txPos = vtxPos.back();
-        return GetTxPosHeight(txPos);
+        CNameDB dbName("cr", *ptxdb);
+        if (dbName.ExistsName(vchKey) && !dbName.ReadName(vchKey, vtxPos))
+            return error("ReadLastNameIndex() : failed to read from name DB");
+    }
+    else
+    {
+        CNameDB dbName("r");
+        if (dbName.ExistsName(vchKey) && !dbName.ReadName(vchKey, vtxPos))
+            return error("ReadLastNameIndex() : failed to read from name DB");
     }
-    return -1;
+
+    if (vtxPos.empty())
+    {
+        nameCache.Fill(vchName, NULL, nWriteCountStart);
+        return false;
+    }
+    txPos = vtxPos.back();
+    nameCache.Fill(vchName, &txPos, nWriteCountStart);
+    return true;
+}
+
+int GetNameHeight(CTxDB& txdb, vector<unsigned char> vchName) {
+    CNameIndex txPos;
+    if (!ReadLastNameIndex(vchName, txPos, &txdb))
+        return -1;
+    return GetTxPosHeight(txPos);
 }
 
 CScript RemoveNameScriptPrefix(const CScript& scriptIn)
@@ -467,32 +653,21 @@ bool GetValueOfTxPos(const CDiskTxPos& txPos, vector<unsigned char>& vchValue, u
     return true;
 }
 
-bool GetValueOfName(CNameDB& dbName, vector<unsigned char> vchName, vector<unsigned char>& vchValue, int& nHeight)
+bool GetValueOfName(vector<unsigned char> vchName, vector<unsigned char>& vchValue, int& nHeight)
 {
-    //vector<CDiskTxPos> vtxPos;
-    vector<CNameIndex> vtxPos;
-    if (!dbName.ReadName(vchName, vtxPos) || vtxPos.empty())
+    CNameIndex txPos;
+    if (!ReadLastNameIndex(vchName, txPos))
         return false;
-    /*CDiskTxPos& txPos = vtxPos.back();
-
-    uint256 hash;
-
-    return GetValueOfTxPos(txPos, vchValue, hash, nHeight);*/
-
-    CNameIndex& txPos = vtxPos.back();
     nHeight = txPos.nHeight;
     vchValue = txPos.vValue;
     return true;
 }
 
-bool GetTxOfName(CNameDB& dbName, vector<unsigned char> vchName, CTransaction& tx)
+bool GetTxOfName(vector<unsigned char> vchName, CTransaction& tx)
 {
-    //vector<CDiskTxPos> vtxPos;
-    vector<CNameIndex> vtxPos;
-    if (!dbName.ReadName(vchName, vtxPos) || vtxPos.empty())
+    CNameIndex txPos;
+    if (!ReadLastNameIndex(vchName, txPos))
         return false;
-    //CDiskTxPos& txPos = vtxPos.back();
-    CNameIndex& txPos = vtxPos.back();
     //int nHeight = GetTxPosHeight(txPos);
     int nHeight = txPos.nHeight;
     if (nHeight + GetExpirationDepth(pindexBest->nHeight) < pindexBest->nHeight)
@@ -536,13 +711,13 @@ Value sendtoname(const Array& params, bool fHelp)
             "<amount> is a real and is rounded to the nearest 0.01");
     
     vector<unsigned char> vchName = vchFromValue(params[0]);
-    CNameDB dbName("r");
-    if (!dbName.ExistsName(vchName))
+    CNameIndex txPos;
+    if (!ReadLastNameIndex(vchName, txPos))
         throw JSONRPCError(-5, "Name not found");
     
     string strAddress;
     CTransaction tx;
-    GetTxOfName(dbName, vchName, tx);
+    GetTxOfName(vchName, tx);
     GetNameAddress(tx, strAddress);
     
     uint160 hash160;
@@ -597,6 +772,7 @@ Value name_list(const Array& params, bool fHelp)
     map< vector<unsigned char>, int > vNamesI;
     map< vector<unsigned char>, Object > vNamesO;
 
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         CTxIndex txindex;
@@ -723,6 +899,25 @@ Value name_debug1(const Array& params, bool fHelp)
     return true;
 }
 
+Value name_cachestats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "name_cachestats\n"
+            "Show statistics of the in-memory name index cache.\n");
+
+    unsigned int nSize, nMaxSize;
+    uint64 nHits, nMisses;
+    nameCache.GetStats(nSize, nMaxSize, nHits, nMisses);
+
+    Object oRes;
+    oRes.push_back(Pair("size", (int)nSize));
+    oRes.push_back(Pair("maxsize", (int)nMaxSize));
+    oRes.push_back(Pair("hits", (boost::int64_t)nHits));
+    oRes.push_back(Pair("misses", (boost::int64_t)nMisses));
+    return oRes;
+}
+
 Value name_show(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -736,16 +931,11 @@ Value name_show(const Array& params, bool fHelp)
     string name = stringFromVch(vchName);
     CRITICAL_BLOCK(cs_main)
     {
-        //vector<CDiskTxPos> vtxPos;
-        vector<CNameIndex> vtxPos;
-        CNameDB dbName("r");
-        if (!dbName.ReadName(vchName, vtxPos))
+        CNameIndex txPosLast;
+        if (!ReadLastNameIndex(vchName, txPosLast))
             throw JSONRPCError(-4, "failed to read from name DB");
-       
-        if (vtxPos.size() < 1)
-            throw JSONRPCError(-4, "no result returned");
 
-        CDiskTxPos txPos = vtxPos[vtxPos.size() - 1].txPos;
+        CDiskTxPos txPos = txPosLast.txPos;
         CTransaction tx;
         if (!tx.ReadFromDisk(txPos))
             throw JSONRPCError(-4, "failed to read from from disk");
@@ -862,63 +1052,76 @@ Value name_filter(const Array& params, bool fHelp)
         fStat = (params[4].get_str() == "stat" ? true : false);
 
 
+    using namespace boost::xpressive;
+    sregex cregex;
+    if (strRegexp != "")
+        cregex = sregex::compile(strRegexp);
+
     CNameDB dbName("r");
     Array oRes;
 
-    vector<unsigned char> vchName;
-    vector<pair<vector<unsigned char>, CNameIndex> > nameScan;
-    if (!dbName.ScanNames(vchName, 100000000, nameScan))
+    Dbc* pcursor = dbName.GetNameCursor();
+    if (!pcursor)
         throw JSONRPCError(-4, "scan failed");
 
-    pair<vector<unsigned char>, CNameIndex> pairScan;
-    BOOST_FOREACH(pairScan, nameScan)
+    // Regex matching and decoding can throw, close the cursor on the way out
+    try
     {
-        string name = stringFromVch(pairScan.first);
+        vector<unsigned char> vchName;
+        unsigned int fFlags = DB_SET_RANGE;
+        loop
+        {
+            CNameIndex txName;
+            int ret = dbName.ReadNameAtCursor(pcursor, vchName, txName, fFlags);
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+                throw JSONRPCError(-4, "scan failed");
 
-        // regexp
-        using namespace boost::xpressive;
-        smatch nameparts;
-        sregex cregex = sregex::compile(strRegexp);
-        if(strRegexp != "" && !regex_search(name, nameparts, cregex))
-            continue;
+            int nHeight = txName.nHeight;
 
-        CNameIndex txName = pairScan.second;
-        int nHeight = txName.nHeight;
+            // max age
+            if(nMaxAge != 0 && pindexBest->nHeight - nHeight >= nMaxAge)
+                continue;
 
-        // max age
-        if(nMaxAge != 0 && pindexBest->nHeight - nHeight >= nMaxAge)
-            continue;
+            // regexp
+            string name = stringFromVch(vchName);
+            smatch nameparts;
+            if(strRegexp != "" && !regex_search(name, nameparts, cregex))
+                continue;
 
-        // from limits
-        nCountFrom++;
-        if(nCountFrom < nFrom + 1)
-            continue;
+            // from limits
+            nCountFrom++;
+            if(nCountFrom < nFrom + 1)
+                continue;
 
-        Object oName;
-        oName.push_back(Pair("name", name));
-        CTransaction tx;
-        CDiskTxPos txPos = txName.txPos;
-        if ((nHeight + GetDisplayExpirationDepth(nHeight) - pindexBest->nHeight <= 0)
-            || txPos.IsNull()
-            || !tx.ReadFromDisk(txPos))
-            //|| !GetValueOfNameTx(tx, vchValue))
-        {
-            oName.push_back(Pair("expired", 1));
-        }
-        else
-        {
-            vector<unsigned char> vchValue = txName.vValue;
-            string value = stringFromVch(vchValue);
-            oName.push_back(Pair("value", value));
-            oName.push_back(Pair("expires_in", nHeight + GetDisplayExpirationDepth(nHeight) - pindexBest->nHeight));
-        }
-        oRes.push_back(oName);
+            Object oName;
+            oName.push_back(Pair("name", name));
+            if ((nHeight + GetDisplayExpirationDepth(nHeight) - pindexBest->nHeight <= 0)
+                || txName.txPos.IsNull())
+            {
+                oName.push_back(Pair("expired", 1));
+            }
+            else
+            {
+                string value = stringFromVch(txName.vValue);
+                oName.push_back(Pair("value", value));
+                oName.push_back(Pair("expires_in", nHeight + GetDisplayExpirationDepth(nHeight) - pindexBest->nHeight));
+            }
+            oRes.push_back(oName);
 
-        nCountNb++;
-        // nb limits
-        if(nNb > 0 && nCountNb >= nNb)
-            break;
+            nCountNb++;
+            // nb limits
+            if(nNb > 0 && nCountNb >= nNb)
+                break;
+        }
+    }
+    catch (...)
+    {
+        pcursor->close();
+        throw;
     }
+    pcursor->close();
 
     if (NAME_DEBUG) {
         dbName.test();
@@ -1007,6 +1210,146 @@ Value name_scan(const Array& params, bool fHelp)
     return oRes;
 }
 
+Array ListNamesByExpiry(int nFromHeight, int nToHeight, int nMax)
+{
+    CNameDB dbName("r");
+    vector<pair<vector<unsigned char>, int> > vResult;
+    if (!dbName.ScanNameExpiry(nFromHeight, nToHeight, nMax, vResult))
+        throw JSONRPCError(-4, "scan failed");
+
+    Array oRes;
+    for (unsigned int i = 0; i < vResult.size(); i++)
+    {
+        Object oName;
+        oName.push_back(Pair("name", stringFromVch(vResult[i].first)));
+        oName.push_back(Pair("expires_at", vResult[i].second));
+        oName.push_back(Pair("expires_in", vResult[i].second - pindexBest->nHeight));
+        oRes.push_back(oName);
+    }
+    return oRes;
+}
+
+Value name_expiring(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+                "name_expiring <blocks> [max=500]\n"
+                "list names that expire within the next <blocks> blocks, soonest first\n"
+                );
+
+    int nBlocks = params[0].get_int();
+    int nMax = 500;
+    if (params.size() > 1)
+        nMax = params[1].get_int();
+    if (nMax < 0)
+        throw JSONRPCError(-8, "Invalid max, must be non-negative");
+
+    CRITICAL_BLOCK(cs_main)
+        return ListNamesByExpiry(pindexBest->nHeight + 1, pindexBest->nHeight + nBlocks, nMax);
+    return Array();
+}
+
+Value name_expired(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+                "name_expired <height> [max=500]\n"
+                "list names that expired at or after block <height>, oldest first\n"
+                );
+
+    int nHeight = params[0].get_int();
+    int nMax = 500;
+    if (params.size() > 1)
+        nMax = params[1].get_int();
+    if (nMax < 0)
+        throw JSONRPCError(-8, "Invalid max, must be non-negative");
+
+    CRITICAL_BLOCK(cs_main)
+        return ListNamesByExpiry(max(nHeight, 0), pindexBest->nHeight, nMax);
+    return Array();
+}
+
+Value name_namespaces(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+                "name_namespaces\n"
+                "list namespaces with the number of names registered in each\n"
+                );
+
+    CNameDB dbName("r");
+    vector<pair<vector<unsigned char>, int> > vCounts;
+    if (!dbName.ListNamespaceCounts(vCounts))
+        throw JSONRPCError(-4, "scan failed");
+
+    Object oRes;
+    for (unsigned int i = 0; i < vCounts.size(); i++)
+        if (vCounts[i].second > 0)
+            oRes.push_back(Pair(stringFromVch(vCounts[i].first), vCounts[i].second));
+    return oRes;
+}
+
+Value name_updated(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 3)
+        throw runtime_error(
+                "name_updated <namespace> <height> [max=500]\n"
+                "list names of <namespace> (e.g. \"d/\", \"\" for names without one) last updated at or after block <height>\n"
+                );
+
+    vector<unsigned char> vchNamespace = vchFromValue(params[0]);
+    int nHeight = params[1].get_int();
+    int nMax = 500;
+    if (params.size() > 2)
+        nMax = params[2].get_int();
+    if (nMax < 0)
+        throw JSONRPCError(-8, "Invalid max, must be non-negative");
+
+    CNameDB dbName("r");
+    vector<pair<vector<unsigned char>, int> > vResult;
+    if (!dbName.ScanNamespace(vchNamespace, max(nHeight, 0), nMax, vResult))
+        throw JSONRPCError(-4, "scan failed");
+
+    Array oRes;
+    for (unsigned int i = 0; i < vResult.size(); i++)
+    {
+        Object oName;
+        oName.push_back(Pair("name", stringFromVch(vResult[i].first)));
+        oName.push_back(Pair("height", vResult[i].second));
+        oRes.push_back(oName);
+    }
+    return oRes;
+}
+
+Value name_byvalue(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+                "name_byvalue <value> [max=500]\n"
+                "list names whose current value is <value> (requires -namevalueindex)\n"
+                );
+
+    if (!fNameValueIndex)
+        throw JSONRPCError(-1, "value index not enabled, restart with -namevalueindex");
+
+    vector<unsigned char> vchValue = vchFromValue(params[0]);
+    int nMax = 500;
+    if (params.size() > 1)
+        nMax = params[1].get_int();
+    if (nMax < 0)
+        throw JSONRPCError(-8, "Invalid max, must be non-negative");
+
+    CNameDB dbName("r");
+    vector<vector<unsigned char> > vResult;
+    if (!dbName.ScanNameValue(Hash(vchValue.begin(), vchValue.end()), nMax, vResult))
+        throw JSONRPCError(-4, "scan failed");
+
+    Array oRes;
+    BOOST_FOREACH(const vector<unsigned char>& vchName, vResult)
+        oRes.push_back(stringFromVch(vchName));
+    return oRes;
+}
+
 Value name_firstupdate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 3 || params.size() > 4)
@@ -1044,9 +1387,8 @@ Value name_firstupdate(const Array& params, bool fHelp)
     }
 
     {
-        CNameDB dbName("r");
         CTransaction tx;
-        if (GetTxOfName(dbName, vchName, tx))
+        if (GetTxOfName(vchName, tx))
         {
             error("name_firstupdate() : this name is already active with tx %s",
                     tx.GetHash().GetHex().c_str());
@@ -1167,9 +1509,8 @@ Value name_update(const Array& params, bool fHelp)
             throw runtime_error("there are pending operations on that name");
         }
 
-        CNameDB dbName("r");
         CTransaction tx;
-        if (!GetTxOfName(dbName, vchName, tx))
+        if (!GetTxOfName(vchName, tx))
         {
             throw runtime_error("could not find a coin with this name");
         }
@@ -1298,14 +1639,15 @@ Value deletetransaction(const Array& params, bool fHelp)
     }
 }
 
-void rescanfornames()
+bool rescanfornames()
 {
     printf("Scanning blockchain for names to create fast index...\n");
 
+    nameCache.Clear();
     CNameDB dbName("cr+");
 
-    // scan blockchain
-    dbName.ReconstructNameIndex();
+    // scan blockchain, a failed scan leaves its checkpoint to resume from
+    return dbName.ReconstructNameIndex();
 }
 
 Value name_clean(const Array& params, bool fHelp)
@@ -1421,11 +1763,140 @@ bool CNameDB::test()
     pcursor->close();
 }
 
+int CNameDB::ReadNameAtCursor(Dbc* pcursor, vector<unsigned char>& vchName, CNameIndex& txPos, unsigned int& fFlags)
+{
+    CDataStream ssKey;
+    if (fFlags == DB_SET_RANGE)
+        ssKey << make_pair(string("namei"), vchName);
+    CDataStream ssValue;
+    int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+    fFlags = DB_NEXT;
+    if (ret != 0)
+        return ret;
+
+    // The name records are contiguous, anything else means we are past them
+    string strType;
+    ssKey >> strType;
+    if (strType != "namei")
+        return DB_NOTFOUND;
+    ssKey >> vchName;
+
+    vector<CNameIndex> vtxPos;
+    ssValue >> vtxPos;
+    txPos = vtxPos.empty() ? CNameIndex() : vtxPos.back();
+    return 0;
+}
+
 bool CNameDB::ScanNames(
         const vector<unsigned char>& vchName,
         int nMax,
         vector<pair<vector<unsigned char>, CNameIndex> >& nameScan)
-        //vector<pair<vector<unsigned char>, CDiskTxPos> >& nameScan)
+{
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    vector<unsigned char> vchCursor = vchName;
+    unsigned int fFlags = DB_SET_RANGE;
+    while (nameScan.size() < nMax)
+    {
+        CNameIndex txPos;
+        int ret = ReadNameAtCursor(pcursor, vchCursor, txPos, fFlags);
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+        nameScan.push_back(make_pair(vchCursor, txPos));
+    }
+    pcursor->close();
+    return true;
+}
+
+bool CNameDB::ScanNameExpiry(int nFromHeight, int nToHeight, int nMax,
+        vector<pair<vector<unsigned char>, int> >& vResult)
+{
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    unsigned int fFlags = DB_SET_RANGE;
+    while (vResult.size() < nMax)
+    {
+        CDataStream ssKey;
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("namex"), make_pair(HeightKey(nFromHeight), vector<unsigned char>()));
+        CDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        ssKey >> strType;
+        if (strType != "namex")
+            break;
+        vector<unsigned char> vchHeight;
+        vector<unsigned char> vchName;
+        ssKey >> vchHeight >> vchName;
+        int nHeight = (vchHeight[0] << 24) | (vchHeight[1] << 16) | (vchHeight[2] << 8) | vchHeight[3];
+        if (nHeight > nToHeight)
+            break;
+        vResult.push_back(make_pair(vchName, nHeight));
+    }
+    pcursor->close();
+    return true;
+}
+
+bool CNameDB::ScanNamespace(const vector<unsigned char>& vchNamespace, int nSinceHeight, int nMax,
+        vector<pair<vector<unsigned char>, int> >& vResult)
+{
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    unsigned int fFlags = DB_SET_RANGE;
+    while (vResult.size() < nMax)
+    {
+        CDataStream ssKey;
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("nameu"), make_pair(vchNamespace, make_pair(HeightKey(nSinceHeight), vector<unsigned char>())));
+        CDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        ssKey >> strType;
+        if (strType != "nameu")
+            break;
+        vector<unsigned char> vchKeyNamespace;
+        vector<unsigned char> vchHeight;
+        vector<unsigned char> vchName;
+        ssKey >> vchKeyNamespace >> vchHeight >> vchName;
+        if (vchKeyNamespace != vchNamespace)
+            break;
+        int nHeight = (vchHeight[0] << 24) | (vchHeight[1] << 16) | (vchHeight[2] << 8) | vchHeight[3];
+        vResult.push_back(make_pair(vchName, nHeight));
+    }
+    pcursor->close();
+    return true;
+}
+
+bool CNameDB::ListNamespaceCounts(vector<pair<vector<unsigned char>, int> >& vResult)
 {
     Dbc* pcursor = GetCursor();
     if (!pcursor)
@@ -1434,104 +1905,353 @@ bool CNameDB::ScanNames(
     unsigned int fFlags = DB_SET_RANGE;
     loop
     {
-        // Read next record
         CDataStream ssKey;
         if (fFlags == DB_SET_RANGE)
-            ssKey << make_pair(string("namei"), vchName);
+            ssKey << make_pair(string("namespacecount"), vector<unsigned char>());
         CDataStream ssValue;
         int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
         fFlags = DB_NEXT;
         if (ret == DB_NOTFOUND)
             break;
         else if (ret != 0)
+        {
+            pcursor->close();
             return false;
+        }
 
-        // Unserialize
         string strType;
         ssKey >> strType;
-        if (strType == "namei")
+        if (strType != "namespacecount")
+            break;
+        vector<unsigned char> vchNamespace;
+        int nCount;
+        ssKey >> vchNamespace;
+        ssValue >> nCount;
+        vResult.push_back(make_pair(vchNamespace, nCount));
+    }
+    pcursor->close();
+    return true;
+}
+
+bool CNameDB::ScanNameValue(const uint256& hashValue, int nMax, vector<vector<unsigned char> >& vResult)
+{
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    unsigned int fFlags = DB_SET_RANGE;
+    while (vResult.size() < nMax)
+    {
+        CDataStream ssKey;
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("namev"), make_pair(hashValue, vector<unsigned char>()));
+        CDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
         {
-            vector<unsigned char> vchName;
-            ssKey >> vchName;
-            string strName = stringFromVch(vchName);
-            //vector<CDiskTxPos> vtxPos;
-            vector<CNameIndex> vtxPos;
-            ssValue >> vtxPos;
-            //CDiskTxPos txPos;
-            CNameIndex txPos;
-            if (!vtxPos.empty())
-            {
-                txPos = vtxPos.back();
-            }
-            nameScan.push_back(make_pair(vchName, txPos));
+            pcursor->close();
+            return false;
         }
 
-        if (nameScan.size() >= nMax)
+        string strType;
+        uint256 hash;
+        ssKey >> strType;
+        if (strType != "namev")
             break;
+        ssKey >> hash;
+        if (hash != hashValue)
+            break;
+        vector<unsigned char> vchName;
+        ssKey >> vchName;
+        vResult.push_back(vchName);
     }
     pcursor->close();
     return true;
 }
 
-bool CNameDB::ReconstructNameIndex()
+bool CNameDB::UpdateSecondaryIndexes(const vector<unsigned char>& vchName,
+        const CNameIndex* ptxPosOld, const CNameIndex* ptxPosNew)
 {
-    CTxDB txdb("r");
-    vector<unsigned char> vchName;
-    vector<unsigned char> vchValue;
-    int nHeight;
-    CTxIndex txindex;
-    CBlockIndex* pindex = pindexGenesisBlock;
-    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+    int nExpiryOld = ptxPosOld ? GetNameExpiryHeight(*ptxPosOld) : -1;
+    int nExpiryNew = ptxPosNew ? GetNameExpiryHeight(*ptxPosNew) : -1;
+    if (nExpiryOld != nExpiryNew)
     {
-        //CNameDB dbName("cr+", txdb);
-        TxnBegin();
+        if (nExpiryOld >= 0 && !EraseNameExpiry(nExpiryOld, vchName))
+            return false;
+        if (nExpiryNew >= 0 && !WriteNameExpiry(nExpiryNew, vchName))
+            return false;
+    }
 
-        while (pindex)
-        {  
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
-            {
-                if (tx.nVersion != NAMECOIN_TX_VERSION)
-                    continue;
+    int nHeightOld = ptxPosOld ? (int)ptxPosOld->nHeight : -1;
+    int nHeightNew = ptxPosNew ? (int)ptxPosNew->nHeight : -1;
+    if (nHeightOld != nHeightNew)
+    {
+        if (nHeightOld >= 0 && !EraseNameUpdated(nHeightOld, vchName))
+            return false;
+        if (nHeightNew >= 0 && !WriteNameUpdated(nHeightNew, vchName))
+            return false;
+    }
 
-                if(!GetNameOfTx(tx, vchName))
-                    continue;
+    // Old value records are removed even without -namevalueindex, so that the
+    // index never holds stale entries
+    uint256 hashValueOld = ptxPosOld ? Hash(ptxPosOld->vValue.begin(), ptxPosOld->vValue.end()) : 0;
+    uint256 hashValueNew = ptxPosNew ? Hash(ptxPosNew->vValue.begin(), ptxPosNew->vValue.end()) : 0;
+    if (ptxPosOld && (!ptxPosNew || hashValueOld != hashValueNew) && !EraseNameValue(hashValueOld, vchName))
+        return false;
+    if (ptxPosNew && fNameValueIndex && (!ptxPosOld || hashValueOld != hashValueNew) && !WriteNameValue(hashValueNew, vchName))
+        return false;
 
-                if(!GetValueOfNameTx(tx, vchValue))
-                    continue;
+    if ((ptxPosOld == NULL) != (ptxPosNew == NULL))
+    {
+        vector<unsigned char> vchNamespace = NamespaceOf(vchName);
+        int nCount;
+        ReadNamespaceCount(vchNamespace, nCount);
+        nCount += (ptxPosNew ? 1 : -1);
+        if (!WriteNamespaceCount(vchNamespace, nCount))
+            return false;
+    }
+    return true;
+}
 
-                if(!txdb.ReadDiskTx(tx.GetHash(), tx, txindex))
-                    continue;
+bool CNameDB::ReindexSecondary()
+{
+    printf("Building secondary name indexes...\n");
+    vector<pair<vector<unsigned char>, CNameIndex> > nameScan;
+    if (!ScanNames(vector<unsigned char>(), 100000000, nameScan))
+        return error("ReindexSecondary() : failed to scan name DB");
+
+    // Records are keyed by the current state of each name, so writing them is
+    // idempotent; the counters are recomputed from scratch
+    map<vector<unsigned char>, int> mapCount;
+    TxnBegin();
+    for (unsigned int i = 0; i < nameScan.size(); i++)
+    {
+        const vector<unsigned char>& vchName = nameScan[i].first;
+        const CNameIndex& txPos = nameScan[i].second;
+        if (txPos.txPos.IsNull())
+            continue;
+        mapCount[NamespaceOf(vchName)]++;
+        if (!WriteNameExpiry(GetNameExpiryHeight(txPos), vchName)
+            || !WriteNameUpdated(txPos.nHeight, vchName)
+            || (fNameValueIndex && !WriteNameValue(Hash(txPos.vValue.begin(), txPos.vValue.end()), vchName)))
+        {
+            TxnAbort();
+            return error("ReindexSecondary() : failed to write to name DB");
+        }
+    }
+    vector<pair<vector<unsigned char>, int> > vCounts;
+    ListNamespaceCounts(vCounts);
+    for (unsigned int i = 0; i < vCounts.size(); i++)
+        mapCount.insert(make_pair(vCounts[i].first, 0));
+    for (map<vector<unsigned char>, int>::iterator mi = mapCount.begin(); mi != mapCount.end(); ++mi)
+        WriteNamespaceCount(mi->first, mi->second);
+    WriteValueIndexed(fNameValueIndex);
+    WriteSecondaryIndexVersion(NAME_SECONDARY_INDEX_VERSION);
+    if (!TxnCommit())
+        return error("ReindexSecondary() : TxnCommit failed");
+    printf("Secondary name indexes built for %d names\n", nameScan.size());
+    return true;
+}
 
-                nHeight = GetTxPosHeight(txindex.pos);
+// Work shared by the name index rebuild workers: each worker claims the next
+// undecoded block of the chunk and stores the name ops it finds in vResults at
+// the same position, so the writer can apply them in chain order.
+class CReconstructChunk
+{
+public:
+    vector<CBlockIndex*> vBlocks;
+    vector<vector<pair<vector<unsigned char>, CNameIndex> > > vResults;
+    CCriticalSection cs;
+    unsigned int nNext;
+    bool fError;
 
-               vector<CNameIndex> vtxPos;
-                if (ExistsName(vchName))
-                {   
-                    if (!ReadName(vchName, vtxPos))
-                        return error("Rescanfornames() : failed to read from name DB");
+    CReconstructChunk()
+    {
+        nNext = 0;
+        fError = false;
+    }
+};
+
+void ThreadDecodeNameBlocks(CReconstructChunk* pchunk)
+{
+    loop
+    {
+        unsigned int i;
+        CRITICAL_BLOCK(pchunk->cs)
+            i = pchunk->nNext++;
+        if (i >= pchunk->vBlocks.size())
+            break;
+
+        CBlockIndex* pindex = pchunk->vBlocks[i];
+        CBlock block;
+        if (!block.ReadFromDisk(pindex, true))
+        {
+            error("ReconstructNameIndex() : could not read block %d", pindex->nHeight);
+            CRITICAL_BLOCK(pchunk->cs)
+                pchunk->fError = true;
+            break;
+        }
+
+        // Same tx positions as CBlock::ConnectBlock stores in the tx index,
+        // so there is no need to look every name tx up with ReadDiskTx
+        unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(block, SER_DISK|SER_BLOCKHEADERONLY) + GetSizeOfCompactSize(block.vtx.size());
+        vector<unsigned char> vchName;
+        BOOST_FOREACH(CTransaction& tx, block.vtx)
+        {
+            CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
+            nTxPos += ::GetSerializeSize(tx, SER_DISK);
+
+            if (tx.nVersion != NAMECOIN_TX_VERSION)
+                continue;
+
+            CNameIndex txPos;
+            if (!GetNameOfTx(tx, vchName) || !GetValueOfNameTx(tx, txPos.vValue))
+                continue;
+            txPos.nHeight = pindex->nHeight;
+            txPos.txPos = posThisTx;
+            pchunk->vResults[i].push_back(make_pair(vchName, txPos));
+        }
+    }
+}
+
+bool CNameDB::ReconstructNameIndex()
+{
+    const unsigned int nChunkSize = 2000;
+    int nThreads = boost::thread::hardware_concurrency();
+    if (nThreads < 1)
+        nThreads = 1;
+
+    CBlockIndex* pindex = pindexGenesisBlock;
+    CRITICAL_BLOCK(cs_main)
+    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+    {
+        // Resume after the last block applied by an interrupted rebuild
+        uint256 hashCheckpoint;
+        if (ReadReconstructCheckpoint(hashCheckpoint))
+        {
+            if (hashCheckpoint != 0)
+            {
+                BlockMap::iterator mi = mapBlockIndex.find(hashCheckpoint);
+                if (mi != mapBlockIndex.end() && (*mi).second->IsInMainChain())
+                {
+                    pindex = (*mi).second->pnext;
+                    printf("ReconstructNameIndex() : resuming at height %d\n", (*mi).second->nHeight + 1);
                 }
-                CNameIndex txPos2;
-                txPos2.nHeight = nHeight;
-                txPos2.vValue = vchValue;
-                txPos2.txPos = txindex.pos;
-                vtxPos.push_back(txPos2);
-                if (!WriteName(vchName, vtxPos))
-                {   
-                    return error("Rescanfornames() : failed to write to name DB");
+                else
+                {
+                    printf("ReconstructNameIndex() : checkpoint is not in the main chain, starting over\n");
+                    vector<pair<vector<unsigned char>, CNameIndex> > nameScan;
+                    if (!ScanNames(vector<unsigned char>(), 100000000, nameScan))
+                        return error("ReconstructNameIndex() : failed to scan name DB");
+                    TxnBegin();
+                    for (unsigned int i = 0; i < nameScan.size(); i++)
+                    {
+                        UpdateSecondaryIndexes(nameScan[i].first, &nameScan[i].second, NULL);
+                        EraseName(nameScan[i].first);
+                    }
+                    WriteReconstructCheckpoint(0);
+                    if (!TxnCommit())
+                        return error("ReconstructNameIndex() : TxnCommit failed");
                 }
+            }
+        }
+        else
+        {
+            TxnBegin();
+            WriteReconstructCheckpoint(0);
+            if (!TxnCommit())
+                return error("ReconstructNameIndex() : TxnCommit failed");
+        }
 
-                //if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                //    ret++;
+        int64 nStart = GetTimeMillis();
+        while (pindex)
+        {
+            CReconstructChunk chunk;
+            for (; pindex && chunk.vBlocks.size() < nChunkSize; pindex = pindex->pnext)
+                chunk.vBlocks.push_back(pindex);
+            chunk.vResults.resize(chunk.vBlocks.size());
+
+            boost::thread_group threads;
+            for (int i = 0; i < nThreads; i++)
+                threads.add_thread(new boost::thread(ThreadDecodeNameBlocks, &chunk));
+            threads.join_all();
+            if (chunk.fError)
+                return error("ReconstructNameIndex() : failed to decode blocks");
+
+            // Collect the new entries of each name in chain order, then read and
+            // write each touched name once per chunk
+            map<vector<unsigned char>, vector<CNameIndex> > mapAppend;
+            for (unsigned int i = 0; i < chunk.vResults.size(); i++)
+                for (unsigned int j = 0; j < chunk.vResults[i].size(); j++)
+                    mapAppend[chunk.vResults[i][j].first].push_back(chunk.vResults[i][j].second);
+
+            TxnBegin();
+            for (map<vector<unsigned char>, vector<CNameIndex> >::iterator mi = mapAppend.begin(); mi != mapAppend.end(); ++mi)
+            {
+                vector<unsigned char> vchName = mi->first;
+                vector<CNameIndex> vtxPos;
+                if (ExistsName(vchName) && !ReadName(vchName, vtxPos))
+                {
+                    TxnAbort();
+                    return error("ReconstructNameIndex() : failed to read from name DB");
+                }
+                CNameIndex txPosOld;
+                bool fHadEntry = !vtxPos.empty();
+                if (fHadEntry)
+                    txPosOld = vtxPos.back();
+                vtxPos.insert(vtxPos.end(), mi->second.begin(), mi->second.end());
+                if (!WriteName(vchName, vtxPos)
+                    || !UpdateSecondaryIndexes(vchName, fHadEntry ? &txPosOld : NULL, &vtxPos.back()))
+                {
+                    TxnAbort();
+                    return error("ReconstructNameIndex() : failed to write to name DB");
+                }
             }
-            pindex = pindex->pnext;
+            CBlockIndex* pindexLast = chunk.vBlocks.back();
+            WriteReconstructCheckpoint(pindexLast->GetBlockHash());
+            if (!TxnCommit())
+                return error("ReconstructNameIndex() : TxnCommit failed");
+            printf("ReconstructNameIndex() : indexed names up to height %d\n", pindexLast->nHeight);
         }
 
-        TxnCommit();
+        TxnBegin();
+        EraseReconstructCheckpoint();
+        WriteValueIndexed(fNameValueIndex);
+        WriteSecondaryIndexVersion(NAME_SECONDARY_INDEX_VERSION);
+        if (!TxnCommit())
+            return error("ReconstructNameIndex() : TxnCommit failed");
+        printf("ReconstructNameIndex() : done in %"PRI64d"ms\n", GetTimeMillis() - nStart);
+    }
+    return true;
+}
+
+void CheckNameSecondaryIndexes()
+{
+    CNameDB dbName("cr+");
+    int nVersion = 0;
+    bool fValueIndexed;
+    dbName.ReadSecondaryIndexVersion(nVersion);
+    dbName.ReadValueIndexed(fValueIndexed);
+    if (nVersion != NAME_SECONDARY_INDEX_VERSION || (fNameValueIndex && !fValueIndexed))
+        dbName.ReindexSecondary();
+    else if (!fNameValueIndex && fValueIndexed)
+    {
+        dbName.TxnBegin();
+        dbName.WriteValueIndexed(false);
+        dbName.TxnCommit();
     }
 }
 
+bool NameIndexRebuildPending()
+{
+    CNameDB dbName("r");
+    uint256 hashCheckpoint;
+    return dbName.ReadReconstructCheckpoint(hashCheckpoint);
+}
+
 CHooks* InitHook()
 {
     mapCallTable.insert(make_pair("name_new", &name_new));
@@ -1540,13 +2260,21 @@ CHooks* InitHook()
     mapCallTable.insert(make_pair("name_list", &name_list));
     mapCallTable.insert(make_pair("name_scan", &name_scan));
     mapCallTable.insert(make_pair("name_filter", &name_filter));
+    mapCallTable.insert(make_pair("name_expiring", &name_expiring));
+    mapCallTable.insert(make_pair("name_expired", &name_expired));
+    mapCallTable.insert(make_pair("name_namespaces", &name_namespaces));
+    mapCallTable.insert(make_pair("name_updated", &name_updated));
+    mapCallTable.insert(make_pair("name_byvalue", &name_byvalue));
     mapCallTable.insert(make_pair("name_show", &name_show));
     mapCallTable.insert(make_pair("name_history", &name_history));
     mapCallTable.insert(make_pair("name_debug", &name_debug));
     mapCallTable.insert(make_pair("name_debug1", &name_debug1));
+    mapCallTable.insert(make_pair("name_cachestats", &name_cachestats));
     mapCallTable.insert(make_pair("name_clean", &name_clean));
     mapCallTable.insert(make_pair("sendtoname", &sendtoname));
     mapCallTable.insert(make_pair("deletetransaction", &deletetransaction));
+    nameCache.SetMaxSize(GetArg("-namecachesize", 50000));
+    fNameValueIndex = GetBoolArg("-namevalueindex");
     hashGenesisBlock = hashNameCoinGenesisBlock;
     printf("Setup namecoin genesis block %s\n", hashGenesisBlock.GetHex().c_str());
     return new CNamecoinHooks();
@@ -1762,10 +2490,7 @@ void CNamecoinHooks::AcceptToMemoryPool(CTxDB& txdb, const CTransaction& tx)
 
 int CheckTransactionAtRelativeDepth(CBlockIndex* pindexBlock, CTxIndex& txindex, int maxDepth)
 {
-    for (CBlockIndex* pindex = pindexBlock; pindex && pindexBlock->nHeight - pindex->nHeight < maxDepth; pindex = pindex->pprev)
-        if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
-            return pindexBlock->nHeight - pindex->nHeight;
-    return -1;
+    return GetAncestorDepth(pindexBlock, txindex.pos, maxDepth);
 }
 
 bool GetNameOfTx(const CTransaction& tx, vector<unsigned char>& name)
@@ -1888,19 +2613,18 @@ bool CNamecoinHooks::ConnectInputs(CTxDB& txdb,
             // name_new expired or not yet in a block
             if (fMiner)
             {
-                // TODO CPU intensive
                 nDepth = CheckTransactionAtRelativeDepth(pindexBlock, vTxindex[nInput], GetExpirationDepth(pindexBlock->nHeight));
                 if (nDepth == -1)
                     return error("ConnectInputsHook() : name_firstupdate cannot be mined if name_new is not already in chain and unexpired");
                 // Check that no other pending txs on this name are already in the block to be mined
                 set<uint256>& setPending = mapNamePending[vvchArgs[0]];
-                BOOST_FOREACH(const PAIRTYPE(uint256, const CTxIndex&)& s, mapTestPool)
+                BOOST_FOREACH(const uint256& hashPending, setPending)
                 {
-                    if (setPending.count(s.first))
+                    if (mapTestPool.count(hashPending))
                     {
                         printf("ConnectInputsHook() : will not mine %s because it clashes with %s",
                                 tx.GetHash().GetHex().c_str(),
-                                s.first.GetHex().c_str());
+                                hashPending.GetHex().c_str());
                         return false;
                     }
                 }
@@ -1909,7 +2633,6 @@ bool CNamecoinHooks::ConnectInputs(CTxDB& txdb,
         case OP_NAME_UPDATE:
             if (!found || (prevOp != OP_NAME_FIRSTUPDATE && prevOp != OP_NAME_UPDATE))
                 return error("name_update tx without previous update tx");
-            // TODO CPU intensive
             nDepth = CheckTransactionAtRelativeDepth(pindexBlock, vTxindex[nInput], GetExpirationDepth(pindexBlock->nHeight));
             if ((fBlock || fMiner) && nDepth < 0)
                 return error("ConnectInputsHook() : name_update on an expired name, or there is a pending transaction on the name");
@@ -1918,38 +2641,17 @@ bool CNamecoinHooks::ConnectInputs(CTxDB& txdb,
             return error("ConnectInputsHook() : name transaction has unknown op");
     }
 
-    if (fBlock)
+    if (fBlock && (op == OP_NAME_FIRSTUPDATE || op == OP_NAME_UPDATE))
     {
-        CNameDB dbName("cr+", txdb);
-
-        dbName.TxnBegin();
-
-        if (op == OP_NAME_FIRSTUPDATE || op == OP_NAME_UPDATE)
-        {
-            //vector<CDiskTxPos> vtxPos;
-            vector<CNameIndex> vtxPos;
-            if (dbName.ExistsName(vvchArgs[0]))
-            {
-                if (!dbName.ReadName(vvchArgs[0], vtxPos))
-                    return error("ConnectInputsHook() : failed to read from name DB");
-            }
-            vector<unsigned char> vchValue; // add
-            int nHeight;
-            uint256 hash;
-            GetValueOfTxPos(txPos, vchValue, hash, nHeight);
-            CNameIndex txPos2;
-            txPos2.nHeight = pindexBlock->nHeight;
-            txPos2.vValue = vchValue;
-            txPos2.txPos = txPos;
-            vtxPos.push_back(txPos2); // fin add
-            //vtxPos.push_back(txPos);
-            if (!dbName.WriteName(vvchArgs[0], vtxPos))
-            {
-                return error("ConnectInputsHook() : failed to write to name DB");
-            }
-        }
-
-        dbName.TxnCommit();
+        vector<CNameIndex>* pvtxPos;
+        if (!GetNameBatchEntry(txdb, vvchArgs[0], pvtxPos))
+            return error("ConnectInputsHook() : failed to read from name DB");
+        CNameIndex txPos2;
+        txPos2.nHeight = pindexBlock->nHeight;
+        GetValueOfNameTx(tx, txPos2.vValue);
+        txPos2.txPos = txPos;
+        pvtxPos->push_back(txPos2);
+        nameCache.Put(vvchArgs[0], &txPos2);
     }
 
     CRITICAL_BLOCK(cs_main)
@@ -1983,14 +2685,10 @@ bool CNamecoinHooks::DisconnectInputs(CTxDB& txdb,
         return error("DisconnectInputsHook() : could not decode namecoin tx");
     if (op == OP_NAME_FIRSTUPDATE || op == OP_NAME_UPDATE)
     {
-        CNameDB dbName("cr+", txdb);
-
-        dbName.TxnBegin();
-
-        //vector<CDiskTxPos> vtxPos;
-        vector<CNameIndex> vtxPos;
-        if (!dbName.ReadName(vvchArgs[0], vtxPos))
+        vector<CNameIndex>* pvtxPos;
+        if (!GetNameBatchEntry(txdb, vvchArgs[0], pvtxPos))
             return error("DisconnectInputsHook() : failed to read from name DB");
+        vector<CNameIndex>& vtxPos = *pvtxPos;
         // vtxPos might be empty if we pruned expired transactions.  However, it should normally still not
         // be empty, since a reorg cannot go that far back.  Be safe anyway and do not try to pop if empty.
         if (vtxPos.size())
@@ -1998,10 +2696,7 @@ bool CNamecoinHooks::DisconnectInputs(CTxDB& txdb,
             vtxPos.pop_back();
             // TODO validate that the first pos is the current tx pos
         }
-        if (!dbName.WriteName(vvchArgs[0], vtxPos))
-            return error("DisconnectInputsHook() : failed to write to name DB");
-
-        dbName.TxnCommit();
+        nameCache.Put(vvchArgs[0], vtxPos.empty() ? NULL : &vtxPos.back());
     }
 
     return true;
@@ -2096,12 +2791,20 @@ bool CNamecoinHooks::ExtractAddress(const CScript& script, string& address)
 
 bool CNamecoinHooks::ConnectBlock(CBlock& block, CTxDB& txdb, CBlockIndex* pindex)
 {
-    return true;
+    return FlushNameBatch(txdb);
 }
 
 bool CNamecoinHooks::DisconnectBlock(CBlock& block, CTxDB& txdb, CBlockIndex* pindex)
 {
-    return true;
+    return FlushNameBatch(txdb);
+}
+
+void CNamecoinHooks::AbortBlockTxn()
+{
+    // The name cache was written through inside the aborted transaction
+    mapNameBatch.clear();
+    mapNameBatchPrev.clear();
+    nameCache.Clear();
 }
 
 bool GenesisBlock(CBlock& block, int extra)
@@ -1,8 +1,34 @@
+// Version of the secondary name indexes, bump when adding an index so that
+// existing name DBs get them built on startup
+static const int NAME_SECONDARY_INDEX_VERSION = 2;
+
+// -namevalueindex: maintain the value hash -> names index
+extern bool fNameValueIndex;
+
 class CNameDB : public CDB
 {
 protected:
     bool fHaveParent;
+
+    // Big endian, so that records keyed by height sort by height
+    static std::vector<unsigned char> HeightKey(int nHeight)
+    {
+        std::vector<unsigned char> vch(4);
+        for (int i = 0; i < 4; i++)
+            vch[i] = (nHeight >> (24 - 8 * i)) & 0xff;
+        return vch;
+    }
+
 public:
+    // "d/example" -> "d/", names without a namespace map to ""
+    static std::vector<unsigned char> NamespaceOf(const std::vector<unsigned char>& name)
+    {
+        std::vector<unsigned char>::const_iterator it = std::find(name.begin(), name.end(), '/');
+        if (it == name.end())
+            return std::vector<unsigned char>();
+        return std::vector<unsigned char>(name.begin(), it + 1);
+    }
+
     CNameDB(const char* pszMode="r+") : CDB("nameindexfull.dat", pszMode) {
         fHaveParent = false;
     }
@@ -40,6 +66,16 @@ public:
         return Erase(make_pair(std::string("namei"), name));
     }
 
+    Dbc* GetNameCursor()
+    {
+        return GetCursor();
+    }
+
+    // Reads the next name record at the cursor.  Start with fFlags = DB_SET_RANGE
+    // to position the cursor at the first name >= vchName.  Returns DB_NOTFOUND
+    // past the last name record.
+    int ReadNameAtCursor(Dbc* pcursor, std::vector<unsigned char>& vchName, CNameIndex& txPos, unsigned int& fFlags);
+
     bool ScanNames(
             const std::vector<unsigned char>& vchName,
             int nMax,
@@ -48,6 +84,173 @@ public:
 
     bool test();
 
+    // Secondary index of names by the height at which their latest entry expires
+    bool WriteNameExpiry(int nExpiryHeight, const std::vector<unsigned char>& name)
+    {
+        return Write(make_pair(std::string("namex"), make_pair(HeightKey(nExpiryHeight), name)), '\0');
+    }
+
+    bool EraseNameExpiry(int nExpiryHeight, const std::vector<unsigned char>& name)
+    {
+        return Erase(make_pair(std::string("namex"), make_pair(HeightKey(nExpiryHeight), name)));
+    }
+
+    // Names whose expiry height is in [nFromHeight, nToHeight], ordered by height
+    bool ScanNameExpiry(int nFromHeight, int nToHeight, int nMax,
+            std::vector<std::pair<std::vector<unsigned char>, int> >& vResult);
+
+    // Per namespace index of names by the height of their latest entry
+    bool WriteNameUpdated(int nHeight, const std::vector<unsigned char>& name)
+    {
+        return Write(make_pair(std::string("nameu"), make_pair(NamespaceOf(name), make_pair(HeightKey(nHeight), name))), '\0');
+    }
+
+    bool EraseNameUpdated(int nHeight, const std::vector<unsigned char>& name)
+    {
+        return Erase(make_pair(std::string("nameu"), make_pair(NamespaceOf(name), make_pair(HeightKey(nHeight), name))));
+    }
+
+    // Names of namespace vchNamespace last updated at or after nSinceHeight, ordered by height
+    bool ScanNamespace(const std::vector<unsigned char>& vchNamespace, int nSinceHeight, int nMax,
+            std::vector<std::pair<std::vector<unsigned char>, int> >& vResult);
+
+    // Number of names with entries, per namespace
+    bool ReadNamespaceCount(const std::vector<unsigned char>& vchNamespace, int& nCount)
+    {
+        nCount = 0;
+        return Read(make_pair(std::string("namespacecount"), vchNamespace), nCount);
+    }
+
+    bool WriteNamespaceCount(const std::vector<unsigned char>& vchNamespace, int nCount)
+    {
+        return Write(make_pair(std::string("namespacecount"), vchNamespace), nCount);
+    }
+
+    bool ListNamespaceCounts(std::vector<std::pair<std::vector<unsigned char>, int> >& vResult);
+
+    // Reverse index from the hash of the latest value of a name to the name
+    bool WriteNameValue(const uint256& hashValue, const std::vector<unsigned char>& name)
+    {
+        return Write(make_pair(std::string("namev"), make_pair(hashValue, name)), '\0');
+    }
+
+    bool EraseNameValue(const uint256& hashValue, const std::vector<unsigned char>& name)
+    {
+        return Erase(make_pair(std::string("namev"), make_pair(hashValue, name)));
+    }
+
+    bool ScanNameValue(const uint256& hashValue, int nMax, std::vector<std::vector<unsigned char> >& vResult);
+
+    // Set once the value index is complete, cleared when -namevalueindex is
+    // turned off (records are then only removed, never added)
+    bool ReadValueIndexed(bool& fIndexed)
+    {
+        fIndexed = false;
+        return Read(std::string("valueindexed"), fIndexed);
+    }
+
+    bool WriteValueIndexed(bool fIndexed)
+    {
+        return Write(std::string("valueindexed"), fIndexed);
+    }
+
+    // Moves the secondary index records of a name from its previous latest entry
+    // to the new one.  NULL means the name had/has no entry.
+    bool UpdateSecondaryIndexes(const std::vector<unsigned char>& name,
+            const CNameIndex* ptxPosOld, const CNameIndex* ptxPosNew);
+
+    bool ReadSecondaryIndexVersion(int& nVersion)
+    {
+        return Read(std::string("secondaryversion"), nVersion);
+    }
+
+    bool WriteSecondaryIndexVersion(int nVersion)
+    {
+        return Write(std::string("secondaryversion"), nVersion);
+    }
+
+    // Builds the secondary indexes from the name records
+    bool ReindexSecondary();
+
+    // Hash of the last block applied by an unfinished ReconstructNameIndex, 0
+    // if it has not applied any block yet.  Absent once the index is complete.
+    bool ReadReconstructCheckpoint(uint256& hashBlock)
+    {
+        return Read(std::string("reconstructhash"), hashBlock);
+    }
+
+    bool WriteReconstructCheckpoint(const uint256& hashBlock)
+    {
+        return Write(std::string("reconstructhash"), hashBlock);
+    }
+
+    bool EraseReconstructCheckpoint()
+    {
+        return Erase(std::string("reconstructhash"));
+    }
+
     bool ReconstructNameIndex();
 }
 ;
+
+// Bounded in-memory cache of the latest CNameIndex of each name, kept in front
+// of CNameDB so that lookups of the current value/height of a name do not have
+// to deserialize the full history vector.  Names known not to exist are cached
+// as well.  The cache is write-through: the block connect/disconnect hooks update
+// it together with the DB, and it is cleared whenever a block transaction is
+// rolled back.
+class CNameCache
+{
+protected:
+    class CEntry
+    {
+    public:
+        CNameIndex txPos;
+        bool fExists;
+        std::list<std::vector<unsigned char> >::iterator itLRU;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<std::vector<unsigned char>, CEntry> mapEntries;
+    std::list<std::vector<unsigned char> > lstLRU; // most recently used at front
+    unsigned int nMaxSize;
+    unsigned int nWriteCount;
+    uint64 nHits;
+    uint64 nMisses;
+
+    void Store(const std::vector<unsigned char>& vchName, const CNameIndex* ptxPos);
+
+public:
+    CNameCache()
+    {
+        nMaxSize = 50000;
+        nWriteCount = 0;
+        nHits = 0;
+        nMisses = 0;
+    }
+
+    // Returns false on a miss.  On a hit fExists tells whether the name has an
+    // entry in the DB, and txPos holds the latest one if it does.
+    bool Get(const std::vector<unsigned char>& vchName, CNameIndex& txPos, bool& fExists);
+
+    // Write-through from the name DB writers.  ptxPos == NULL records that the
+    // name has no entries.
+    void Put(const std::vector<unsigned char>& vchName, const CNameIndex* ptxPos);
+
+    // Fill after a miss.  Dropped if any write happened since nWriteCountStart,
+    // so that a concurrent block connect can not be overwritten with stale data.
+    void Fill(const std::vector<unsigned char>& vchName, const CNameIndex* ptxPos, unsigned int nWriteCountStart);
+
+    unsigned int GetWriteCount() const
+    {
+        CRITICAL_BLOCK(cs)
+            return nWriteCount;
+        return 0;
+    }
+
+    void Clear();
+    void SetMaxSize(unsigned int nSize);
+    void GetStats(unsigned int& nSize, unsigned int& nMaxSizeRet, uint64& nHitsRet, uint64& nMissesRet) const;
+};
+
+extern CNameCache nameCache;
@@ -31,6 +31,7 @@ using namespace boost;
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
 
 void ThreadMessageHandler2(void* parg);
+void ThreadMessageWorker(void* parg);
 void ThreadSocketHandler2(void* parg);
 void ThreadOpenConnections2(void* parg);
 #ifdef USE_UPNP
@@ -53,6 +54,12 @@ CNode* pnodeLocalHost = NULL;
 uint64 nLocalHostNonce = 0;
 array<int, 10> vnThreadsRunning;
 SOCKET hListenSocket = INVALID_SOCKET;
+#ifdef USE_EPOLL
+static const int MAX_EPOLL_EVENTS = 256;
+static int hEpoll = -1;
+static int hEpollWakeup = -1;
+static vector<CNode*> vNodesNew; // guarded by cs_vNodes
+#endif
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
@@ -63,11 +70,32 @@ deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64> mapAlreadyAskedFor;
 
+// Message work queue.  A node is on the queue at most once and is only ever
+// serviced by one worker at a time, so its messages are handled in order.
+static const int64 NODE_WORK_TICK = 100;
+static const unsigned int NODE_WORK_WHEEL_SLOTS = 1024;
+static const int MAX_MESSAGE_THREADS = 16;
+static boost::mutex mutexNodeWork;
+static boost::condition_variable condNodeWork;
+static int nMessageWorkersAlive = 0;
+static deque<CNode*> queueNodeWork;
+static CTimerWheel<CNode*> wheelNodeWork(NODE_WORK_TICK, NODE_WORK_WHEEL_SLOTS, GetTimeMillis());
+static uint64 nNodeWorkRuns = 0;
+static int64 nNodeWorkWaitTotal = 0;
+static int64 nNodeWorkWaitMax = 0;
+static int64 nNodeWorkBusyTotal = 0;
+static uint64 nBlockRelays = 0;
+static int64 nBlockRelayTotal = 0;
+static int64 nBlockRelayMax = 0;
+
 // Settings
 int fUseProxy = false;
 int nConnectTimeout = 5000;
 CAddress addrProxy("127.0.0.1",9050);
 
+// Most buffers handed to one sendmsg call
+static const unsigned int MAX_SEND_IOV = 64;
+
 
 
 
@@ -76,6 +104,23 @@ unsigned short GetListenPort()
     return (unsigned short)(GetArg("-port", GetDefaultPort()));
 }
 
+void FinishMessageHeader(CDataStream& s, unsigned int nHeaderStart, unsigned int nMessageStart)
+{
+    // Set the size
+    unsigned int nSize = s.size() - nMessageStart;
+    memcpy((char*)&s[nHeaderStart] + offsetof(CMessageHeader, nMessageSize), &nSize, sizeof(nSize));
+
+    // Set the checksum
+    if (s.GetVersion() >= 209)
+    {
+        uint256 hash = Hash(s.begin() + nMessageStart, s.end());
+        unsigned int nChecksum = 0;
+        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+        assert(nMessageStart - nHeaderStart >= offsetof(CMessageHeader, nChecksum) + sizeof(nChecksum));
+        memcpy((char*)&s[nHeaderStart] + offsetof(CMessageHeader, nChecksum), &nChecksum, sizeof(nChecksum));
+    }
+}
+
 void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
 {
     // Filter out duplicate requests
@@ -83,6 +128,7 @@ void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
         return;
     pindexLastGetBlocksBegin = pindexBegin;
     hashLastGetBlocksEnd = hashEnd;
+    nLastGetBlocksTime = GetTime();
 
     PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
@@ -631,6 +677,20 @@ CNode* FindNode(CAddress addr)
     return NULL;
 }
 
+// The socket thread registers new nodes with epoll from vNodesNew, which
+// holds a reference until the node is in its ready list
+void static AddNode(CNode* pnode)
+{
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        vNodes.push_back(pnode);
+#ifdef USE_EPOLL
+        pnode->AddRef();
+        vNodesNew.push_back(pnode);
+#endif
+    }
+}
+
 CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
 {
     if (addrConnect.ip == addrLocalHost.ip)
@@ -679,8 +739,8 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
             pnode->AddRef(nTimeout);
         else
             pnode->AddRef();
-        CRITICAL_BLOCK(cs_vNodes)
-            vNodes.push_back(pnode);
+        AddNode(pnode);
+        WakeSocketHandler();
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -699,11 +759,85 @@ void CNode::CloseSocketDisconnect()
         if (fDebug)
             printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
         printf("disconnecting node %s\n", addr.ToString().c_str());
+#ifdef USE_EPOLL
+        // Unregister under cs_vSend so NotifySend never touches a closed
+        // socket handle that may already have been reused
+        CRITICAL_BLOCK(cs_vSend)
+        {
+            if (fPollRegistered)
+            {
+                struct epoll_event event;
+                epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &event);
+                fPollRegistered = false;
+            }
+        }
+#endif
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
 }
 
+#ifdef USE_EPOLL
+bool static SetPollEvents(CNode* pnode, int nOp)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET | (pnode->fPollSend ? EPOLLOUT : 0);
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, nOp, pnode->hSocket, &event) == -1)
+    {
+        printf("epoll_ctl failed for %s, error %d\n", pnode->addr.ToString().c_str(), errno);
+        return false;
+    }
+    return true;
+}
+
+void static RegisterPollSocket(CNode* pnode)
+{
+    CRITICAL_BLOCK(pnode->cs_vSend)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            return;
+        pnode->fPollSend = !pnode->vSendMsg.empty();
+        if (!SetPollEvents(pnode, EPOLL_CTL_ADD))
+        {
+            pnode->CloseSocketDisconnect();
+            return;
+        }
+        pnode->fPollRegistered = true;
+
+        // Anything that arrived before registration produced no edge
+        pnode->fRecvReady = true;
+        pnode->fSendReady = true;
+    }
+}
+#endif
+
+// Called with cs_vSend held whenever a message is queued, so the socket
+// thread starts watching for write readiness as soon as there is something
+// to send
+void CNode::NotifySend()
+{
+#ifdef USE_EPOLL
+    if (fPollRegistered && !fPollSend)
+    {
+        fPollSend = true;
+        SetPollEvents(this, EPOLL_CTL_MOD);
+    }
+#endif
+}
+
+void WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hEpollWakeup != -1)
+    {
+        uint64 nOne = 1;
+        if (write(hEpollWakeup, &nOne, sizeof(nOne)) != sizeof(nOne))
+            printf("WakeSocketHandler() : write failed, error %d\n", errno);
+    }
+#endif
+}
+
 void CNode::Cleanup()
 {
     // All of a nodes broadcasts and subscriptions are automatically torn down
@@ -746,58 +880,335 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exiting\n");
 }
 
+bool static AcceptConnection()
+{
+    struct sockaddr_in sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr(sockaddr);
+    int nInbound = 0;
+
+    CRITICAL_BLOCK(cs_vNodes)
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        if (pnode->fInbound)
+            nInbound++;
+    if (hSocket == INVALID_SOCKET)
+    {
+        if (WSAGetLastError() != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", WSAGetLastError());
+        return false;
+    }
+    else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, true);
+        pnode->AddRef();
+        AddNode(pnode);
+    }
+    return true;
+}
+
+int CNetMessage::ReadHeader(const char* pch, unsigned int nBytes)
+{
+    // Collect the header, it may arrive in pieces
+    unsigned int nCopy = min((unsigned int)hdrbuf.size() - nHdrPos, nBytes);
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+    if (nHdrPos < hdrbuf.size())
+        return nCopy;
+
+    try
+    {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception& e) {
+        return -1;
+    }
+    if (!hdr.IsValid())
+        return -1;
+
+    // Blocks are the largest messages we expect, anything announced as
+    // bigger grows as it arrives instead of being allocated up front
+    fInData = true;
+    vRecv.resize(min(hdr.nMessageSize, (unsigned int)MAX_BLOCK_SIZE));
+    return nCopy;
+}
+
+unsigned int CNetMessage::PrepareData(unsigned int nWant)
+{
+    nWant = min(nWant, hdr.nMessageSize - nDataPos);
+    if (vRecv.size() < nDataPos + nWant)
+        vRecv.resize(min(hdr.nMessageSize, max(nDataPos + nWant, 2 * (unsigned int)vRecv.size())));
+    return vRecv.size() - nDataPos;
+}
+
+int CNetMessage::ReadData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nCopy = min(nBytes, PrepareData(nBytes));
+    memcpy(&vRecv[nDataPos], pch, nCopy);
+    nDataPos += nCopy;
+    return nCopy;
+}
+
+// Split received bytes into messages, cs_vRecv must be held.
+// Returns false if the peer has to be disconnected.
+bool static ReceiveMessageBytes(CNode* pnode, const char* pch, unsigned int nBytes, bool& fMessageReady)
+{
+    while (nBytes > 0)
+    {
+        if (pnode->vRecvMsg.empty() || pnode->vRecvMsg.back().IsComplete())
+            pnode->vRecvMsg.push_back(CNetMessage(SER_NETWORK, pnode->nRecvVersion));
+        CNetMessage& msg = pnode->vRecvMsg.back();
+
+        bool fInData = msg.fInData;
+        int nHandled = fInData ? msg.ReadData(pch, nBytes) : msg.ReadHeader(pch, nBytes);
+        if (nHandled < 0)
+        {
+            if (!pnode->fDisconnect)
+                printf("socket recv invalid message header, disconnect\n");
+            return false;
+        }
+        if (!fInData && msg.fInData && msg.hdr.nMessageSize > ReceiveBufferSize())
+        {
+            if (!pnode->fDisconnect)
+                printf("socket recv flood control disconnect (%u bytes)\n", msg.hdr.nMessageSize);
+            return false;
+        }
+        pch += nHandled;
+        nBytes -= nHandled;
+
+        if (msg.IsComplete())
+        {
+            pnode->nRecvQueueSize += msg.vRecv.size();
+            fMessageReady = true;
+        }
+    }
+    return true;
+}
+
+// Receive what the socket has for the node, cs_vRecv must be held.
+// Returns false once there is nothing more to read right now.
+// fMessageReady is set when a message has been completed.
+bool static SocketRecvData(CNode* pnode, bool& fMessageReady)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    char* pch = pchBuf;
+    unsigned int nSize = sizeof(pchBuf);
+
+    // The rest of a large payload is received straight into its message
+    CNetMessage* pmsg = NULL;
+    if (!pnode->vRecvMsg.empty())
+    {
+        CNetMessage& msg = pnode->vRecvMsg.back();
+        if (msg.fInData && !msg.IsComplete() && msg.hdr.nMessageSize - msg.nDataPos >= sizeof(pchBuf))
+        {
+            pmsg = &msg;
+            nSize = msg.PrepareData(sizeof(pchBuf));
+            pch = &msg.vRecv[msg.nDataPos];
+        }
+    }
+
+    int nBytes = recv(pnode->hSocket, pch, nSize, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pmsg)
+        {
+            pmsg->nDataPos += nBytes;
+            if (pmsg->IsComplete())
+            {
+                pnode->nRecvQueueSize += pmsg->vRecv.size();
+                fMessageReady = true;
+            }
+        }
+        else if (!ReceiveMessageBytes(pnode, pchBuf, nBytes, fMessageReady))
+        {
+            pnode->CloseSocketDisconnect();
+            return false;
+        }
+        pnode->nLastRecv = GetTime();
+        return true;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            printf("socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEINTR)
+            return true;
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                printf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+// Send as much of the send queue as the socket takes, cs_vSend must be held.
+// Returns false once the socket would block or failed.
+bool static SocketSendData(CNode* pnode)
+{
+    bool fMore = false;
+#ifdef __WXMSW__
+    const CDataStream& vFront = *pnode->vSendMsg.front();
+    int nBytes = send(pnode->hSocket, &vFront[pnode->nSendOffset], vFront.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    // Hand the front of the queue to the kernel in one call
+    struct iovec iov[MAX_SEND_IOV];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    unsigned int nOffset = pnode->nSendOffset;
+    for (deque<SendBuffer>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && msg.msg_iovlen < MAX_SEND_IOV; it++)
+    {
+        iov[msg.msg_iovlen].iov_base = (void*)&(**it)[nOffset];
+        iov[msg.msg_iovlen].iov_len = (*it)->size() - nOffset;
+        msg.msg_iovlen++;
+        nOffset = 0;
+    }
+    int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+    if (nBytes > 0)
+    {
+        // Drop what went out, only the offset into the front buffer moves
+        pnode->nSendSize -= nBytes;
+        while (nBytes > 0)
+        {
+            unsigned int nFront = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+            if ((unsigned int)nBytes < nFront)
+            {
+                pnode->nSendOffset += nBytes;
+                break;
+            }
+            nBytes -= nFront;
+            pnode->nSendOffset = 0;
+            pnode->vSendMsg.pop_front();
+        }
+        pnode->nLastSend = GetTime();
+        fMore = true;
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            printf("socket send error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+        fMore = (nErr == WSAEINTR);
+    }
+    if (pnode->nSendSize > SendBufferSize()) {
+        if (!pnode->fDisconnect)
+            printf("socket send flood control disconnect (%"PRI64u" bytes)\n", pnode->nSendSize);
+        pnode->CloseSocketDisconnect();
+        fMore = false;
+    }
+    return fMore && pnode->hSocket != INVALID_SOCKET;
+}
+
 void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
     int nPrevNodeCount = 0;
+    int64 nLastInactivityCheck = 0;
+
+#ifdef USE_EPOLL
+    hEpoll = epoll_create(MAX_EPOLL_EVENTS);
+    hEpollWakeup = eventfd(0, EFD_NONBLOCK);
+    if (hEpoll == -1 || hEpollWakeup == -1)
+    {
+        printf("ThreadSocketHandler() : epoll setup failed, error %d\n", errno);
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &hEpollWakeup;
+    epoll_ctl(hEpoll, EPOLL_CTL_ADD, hEpollWakeup, &event);
+    if (hListenSocket != INVALID_SOCKET)
+    {
+        // The listen socket is the only one registered without a node
+        event.data.ptr = NULL;
+        epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event);
+    }
+
+    // Nodes with an event to handle or left over from the last pass, each
+    // holding a reference.  Only these are serviced, the rest of vNodes is
+    // walked once a second to disconnect and time out nodes.
+    vector<CNode*> vNodesReady;
+    int64 nLastSweep = 0;
+#endif
 
     loop
     {
+#ifdef USE_EPOLL
+        bool fSweep = (GetTime() != nLastSweep);
+        if (fSweep)
+            nLastSweep = GetTime();
+#else
+        bool fSweep = true;
+#endif
+
         //
         // Disconnect nodes
         //
-        CRITICAL_BLOCK(cs_vNodes)
+        if (fSweep)
         {
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            CRITICAL_BLOCK(cs_vNodes)
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                // Disconnect unused nodes
+                vector<CNode*> vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
-
-                    // hold in disconnected pool until all refs are released
-                    pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+                    if (pnode->fDisconnect ||
+                        (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->vSendMsg.empty()))
+                    {
+                        // remove from vNodes
+                        vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                        // close socket and cleanup
+                        pnode->CloseSocketDisconnect();
+                        pnode->Cleanup();
+
+                        // hold in disconnected pool until all refs are released
+                        pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
+                        if (pnode->fNetworkNode || pnode->fInbound)
+                            pnode->Release();
+                        vNodesDisconnected.push_back(pnode);
+                    }
                 }
-            }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
-            {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                // Delete disconnected nodes
+                list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+                BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
                 {
-                    bool fDelete = false;
-                    TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                     TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
-                      TRY_CRITICAL_BLOCK(pnode->cs_mapRequests)
-                       TRY_CRITICAL_BLOCK(pnode->cs_inventory)
-                        fDelete = true;
-                    if (fDelete)
+                    // wait until threads are done using it
+                    if (pnode->GetRefCount() <= 0)
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        bool fDelete = false;
+                        TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+                         TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+                          TRY_CRITICAL_BLOCK(pnode->cs_mapRequests)
+                           TRY_CRITICAL_BLOCK(pnode->cs_inventory)
+                            fDelete = true;
+                        if (fDelete)
+                        {
+                            vNodesDisconnected.remove(pnode);
+                            delete pnode;
+                        }
                     }
                 }
             }
@@ -809,6 +1220,150 @@ void ThreadSocketHandler2(void* parg)
         }
 
 
+#ifdef USE_EPOLL
+        //
+        // Wait for socket events.  They are edge triggered, so readiness is
+        // remembered on the node until the socket would block again.
+        //
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        vnThreadsRunning[0]--;
+        int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, !vNodesReady.empty() ? 10 : 1000);
+        vnThreadsRunning[0]++;
+        if (fShutdown)
+            return;
+        if (nEvents == -1 && errno != EINTR)
+        {
+            printf("socket epoll_wait error %d\n", errno);
+            Sleep(10);
+        }
+
+        bool fAccept = false;
+        unsigned int nPrevReady = vNodesReady.size();
+        for (int i = 0; i < nEvents; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                fAccept = true;
+            }
+            else if (events[i].data.ptr == &hEpollWakeup)
+            {
+                uint64 nCount;
+                while (read(hEpollWakeup, &nCount, sizeof(nCount)) > 0)
+                    ;
+            }
+            else
+            {
+                // Registered nodes are only deleted by this thread, after
+                // their socket has been taken out of epoll
+                CNode* pnode = (CNode*)events[i].data.ptr;
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    pnode->fRecvReady = true;
+                if (events[i].events & EPOLLOUT)
+                    pnode->fSendReady = true;
+                if (!pnode->fPollReady)
+                {
+                    pnode->fPollReady = true;
+                    vNodesReady.push_back(pnode);
+                }
+            }
+        }
+
+        //
+        // Accept new connections, all of them since the edge won't repeat
+        //
+        if (fAccept)
+            while (AcceptConnection())
+                ;
+
+        //
+        // Register new nodes, they come with a reference for the ready list
+        //
+        vector<CNode*> vNodesAdded;
+        CRITICAL_BLOCK(cs_vNodes)
+        {
+            for (unsigned int i = nPrevReady; i < vNodesReady.size(); i++)
+                vNodesReady[i]->AddRef();
+            vNodesAdded.swap(vNodesNew);
+        }
+        BOOST_FOREACH(CNode* pnode, vNodesAdded)
+        {
+            RegisterPollSocket(pnode);
+            if (!pnode->fPollReady)
+            {
+                pnode->fPollReady = true;
+                vNodesReady.push_back(pnode);
+            }
+            else
+                CRITICAL_BLOCK(cs_vNodes)
+                    pnode->Release();
+        }
+
+
+        //
+        // Service each ready socket, keeping the ones that still have
+        // something to do: a lock that was busy or a paused receive
+        //
+        vector<CNode*> vNodesService;
+        vNodesService.swap(vNodesReady);
+        vector<CNode*> vNodesDone;
+        BOOST_FOREACH(CNode* pnode, vNodesService)
+        {
+            if (fShutdown)
+                return;
+
+            if (pnode->hSocket != INVALID_SOCKET)
+            {
+                //
+                // Receive
+                //
+                bool fMessageReady = false;
+                if (pnode->fRecvReady)
+                {
+                    TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+                    {
+                        // While paused the socket stays marked readable, the
+                        // edge for what is already buffered won't come again
+                        while (!pnode->IsRecvPaused() && SocketRecvData(pnode, fMessageReady))
+                            ;
+                        if (!pnode->IsRecvPaused())
+                            pnode->fRecvReady = false;
+                    }
+                }
+                if (fMessageReady)
+                    QueueNodeWork(pnode);
+
+                //
+                // Send, and stop watching for write readiness once drained
+                //
+                if (pnode->fSendReady && pnode->hSocket != INVALID_SOCKET)
+                {
+                    TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+                    {
+                        while (!pnode->vSendMsg.empty() && SocketSendData(pnode))
+                            ;
+                        pnode->fSendReady = false;
+                        if (pnode->vSendMsg.empty() && pnode->fPollRegistered && pnode->fPollSend)
+                        {
+                            pnode->fPollSend = false;
+                            SetPollEvents(pnode, EPOLL_CTL_MOD);
+                        }
+                    }
+                }
+            }
+
+            if (pnode->hSocket != INVALID_SOCKET && (pnode->fRecvReady || pnode->fSendReady))
+                vNodesReady.push_back(pnode);
+            else
+            {
+                pnode->fPollReady = false;
+                vNodesDone.push_back(pnode);
+            }
+        }
+        if (!vNodesDone.empty())
+            CRITICAL_BLOCK(cs_vNodes)
+                BOOST_FOREACH(CNode* pnode, vNodesDone)
+                    pnode->Release();
+#else
         //
         // Find which sockets have data to receive
         //
@@ -833,11 +1388,14 @@ void ThreadSocketHandler2(void* parg)
             {
                 if (pnode->hSocket == INVALID_SOCKET || pnode->hSocket < 0)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
+                // Leave paused peers' data in the kernel until the workers catch up
+                TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+                    if (!pnode->IsRecvPaused())
+                        FD_SET(pnode->hSocket, &fdsetRecv);
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                    if (!pnode->vSend.empty())
+                    if (!pnode->vSendMsg.empty())
                         FD_SET(pnode->hSocket, &fdsetSend);
             }
         }
@@ -862,39 +1420,12 @@ void ThreadSocketHandler2(void* parg)
         }
 
 
+
         //
         // Accept new connections
         //
         if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-            struct sockaddr_in sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr(sockaddr);
-            int nInbound = 0;
-
-            CRITICAL_BLOCK(cs_vNodes)
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                if (pnode->fInbound)
-                    nInbound++;
-            if (hSocket == INVALID_SOCKET)
-            {
-                if (WSAGetLastError() != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", WSAGetLastError());
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, true);
-                pnode->AddRef();
-                CRITICAL_BLOCK(cs_vNodes)
-                    vNodes.push_back(pnode);
-            }
-        }
+            AcceptConnection();
 
 
         //
@@ -919,46 +1450,12 @@ void ThreadSocketHandler2(void* parg)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
+                bool fMessageReady = false;
                 TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
-                {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
-                        if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%d bytes)\n", vRecv.size());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
-                            pnode->nLastRecv = GetTime();
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    if (!pnode->IsRecvPaused())
+                        SocketRecvData(pnode, fMessageReady);
+                if (fMessageReady)
+                    QueueNodeWork(pnode);
             }
 
             //
@@ -969,66 +1466,54 @@ void ThreadSocketHandler2(void* parg)
             if (FD_ISSET(pnode->hSocket, &fdsetSend))
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+                    if (!pnode->vSendMsg.empty())
+                        SocketSendData(pnode);
+            }
+        }
+        CRITICAL_BLOCK(cs_vNodes)
+        {
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+#endif
+
+        //
+        // Inactivity checking
+        //
+        if (GetTime() != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = GetTime();
+            CRITICAL_BLOCK(cs_vNodes)
+            {
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    if (pnode->vSendMsg.empty())
+                        pnode->nLastSendEmpty = GetTime();
+                    if (GetTime() - pnode->nTimeConnected > 60)
                     {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
+                        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
                         {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
+                            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+                            pnode->fDisconnect = true;
                         }
-                        else if (nBytes < 0)
+                        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
                         {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
+                            printf("socket not sending\n");
+                            pnode->fDisconnect = true;
                         }
-                        if (vSend.size() > SendBufferSize()) {
-                            if (!pnode->fDisconnect)
-                                printf("socket send flood control disconnect (%d bytes)\n", vSend.size());
-                            pnode->CloseSocketDisconnect();
+                        else if (GetTime() - pnode->nLastRecv > 90*60)
+                        {
+                            printf("socket inactivity timeout\n");
+                            pnode->fDisconnect = true;
                         }
                     }
                 }
             }
-
-            //
-            // Inactivity checking
-            //
-            if (pnode->vSend.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
-        }
-        CRITICAL_BLOCK(cs_vNodes)
-        {
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
         }
 
+#ifndef USE_EPOLL
         Sleep(10);
+#endif
     }
 }
 
@@ -1438,56 +1923,214 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exiting\n");
 }
 
-void ThreadMessageHandler2(void* parg)
+// Queue the node for a message worker.  If a worker already has it, it
+// goes around again once that worker is done.
+void QueueNodeWork(CNode* pnode, bool fTrickle)
 {
-    printf("ThreadMessageHandler started\n");
+    // cs_vNodes is taken first everywhere, it covers the reference count
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        boost::lock_guard<boost::mutex> lock(mutexNodeWork);
+        if (fTrickle)
+            pnode->fWorkTrickle = true;
+        if (pnode->fWorkRunning)
+        {
+            pnode->fWorkPending = true;
+            return;
+        }
+        if (pnode->fWorkQueued)
+            return;
+        pnode->AddRef();
+        pnode->fWorkQueued = true;
+        pnode->nWorkQueuedTime = GetTimeMicros();
+        queueNodeWork.push_back(pnode);
+        condNodeWork.notify_one();
+    }
+}
+
+void ScheduleNodeWork(CNode* pnode, int64 nTimeMillis)
+{
+    boost::lock_guard<boost::mutex> lock(mutexNodeWork);
+    wheelNodeWork.Schedule(nTimeMillis, pnode);
+}
+
+void RecordBlockRelayDelay(int64 nMicros)
+{
+    boost::lock_guard<boost::mutex> lock(mutexNodeWork);
+    nBlockRelays++;
+    nBlockRelayTotal += nMicros;
+    nBlockRelayMax = max(nBlockRelayMax, nMicros);
+}
+
+void GetMessageWorkStats(uint64& nRuns, int64& nWaitTotal, int64& nWaitMax, int64& nBusyTotal,
+                         uint64& nBlockRelaysRet, int64& nBlockRelayTotalRet, int64& nBlockRelayMaxRet)
+{
+    boost::lock_guard<boost::mutex> lock(mutexNodeWork);
+    nRuns = nNodeWorkRuns;
+    nWaitTotal = nNodeWorkWaitTotal;
+    nWaitMax = nNodeWorkWaitMax;
+    nBusyTotal = nNodeWorkBusyTotal;
+    nBlockRelaysRet = nBlockRelays;
+    nBlockRelayTotalRet = nBlockRelayTotal;
+    nBlockRelayMaxRet = nBlockRelayMax;
+}
+
+void static ServiceNode(CNode* pnode, bool fTrickle)
+{
+    if (pnode->fDisconnect)
+        return;
+
+    // Receive messages.  ProcessMessages only holds cs_vRecv to take the
+    // complete messages, so the socket thread can keep receiving meanwhile.
+    ProcessMessages(pnode);
+    if (fShutdown)
+        return;
+
+    // Send messages.  cs_main is taken before cs_vSend, the order relaying
+    // from ProcessMessage takes them in, so workers can't deadlock each other.
+    CRITICAL_BLOCK(cs_main)
+        CRITICAL_BLOCK(pnode->cs_vSend)
+            SendMessages(pnode, fTrickle);
+}
+
+void ThreadMessageWorker(void* parg)
+{
+    printf("ThreadMessageWorker started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+
+    // vnThreadsRunning[6] and nMessageWorkersAlive are only touched with
+    // mutexNodeWork held
+    boost::unique_lock<boost::mutex> lock(mutexNodeWork);
+    vnThreadsRunning[6]++;
     while (!fShutdown)
     {
-        vector<CNode*> vNodesCopy;
-        CRITICAL_BLOCK(cs_vNodes)
+        if (queueNodeWork.empty())
         {
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+            vnThreadsRunning[6]--;
+            condNodeWork.wait(lock);
+            vnThreadsRunning[6]++;
+            continue;
         }
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        CNode* pnode = queueNodeWork.front();
+        queueNodeWork.pop_front();
+        pnode->fWorkQueued = false;
+        pnode->fWorkRunning = true;
+        bool fTrickle = pnode->fWorkTrickle;
+        pnode->fWorkTrickle = false;
+        int64 nStart = GetTimeMicros();
+        int64 nWait = nStart - pnode->nWorkQueuedTime;
+        lock.unlock();
+
+        try
         {
-            // Receive messages
-            TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
-                ProcessMessages(pnode);
-            if (fShutdown)
-                return;
-
-            // Send messages
-            TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                SendMessages(pnode, pnode == pnodeTrickle);
-            if (fShutdown)
-                return;
+            ServiceNode(pnode, fTrickle);
         }
+        catch (std::exception& e) {
+            PrintException(&e, "ThreadMessageWorker()");
+        } catch (...) {
+            PrintException(NULL, "ThreadMessageWorker()");
+        }
+        int64 nBusy = GetTimeMicros() - nStart;
 
         CRITICAL_BLOCK(cs_vNodes)
         {
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            lock.lock();
+            pnode->fWorkRunning = false;
+            if (pnode->fWorkPending && !fShutdown)
+            {
+                // Keep the reference for the next turn
+                pnode->fWorkPending = false;
+                pnode->fWorkQueued = true;
+                pnode->nWorkQueuedTime = GetTimeMicros();
+                queueNodeWork.push_back(pnode);
+            }
+            else
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        nNodeWorkRuns++;
+        nNodeWorkWaitTotal += nWait;
+        nNodeWorkWaitMax = max(nNodeWorkWaitMax, nWait);
+        nNodeWorkBusyTotal += nBusy;
+    }
+    vnThreadsRunning[6]--;
+    nMessageWorkersAlive--;
+    printf("ThreadMessageWorker exiting\n");
+}
+
+void ThreadMessageHandler2(void* parg)
+{
+    printf("ThreadMessageHandler started\n");
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+
+    // Messages are handled by the workers as soon as the socket thread has
+    // them, this thread only runs the timers: retried getdata requests and
+    // the trickle that hands addr and tx invs to one random node per tick.
+    while (!fShutdown)
+    {
+        vector<CNode*> vExpired;
+        {
+            boost::lock_guard<boost::mutex> lock(mutexNodeWork);
+            wheelNodeWork.Advance(GetTimeMillis(), vExpired);
+        }
+
+        CRITICAL_BLOCK(cs_vNodes)
+        {
+            // Timers don't hold a reference, so only wake nodes that are
+            // still connected
+            BOOST_FOREACH(CNode* pnode, vExpired)
+                if (find(vNodes.begin(), vNodes.end(), pnode) != vNodes.end())
+                    QueueNodeWork(pnode);
+
+            if (!vNodes.empty())
+                QueueNodeWork(vNodes[GetRand(vNodes.size())], true);
+        }
+
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
         vnThreadsRunning[2]--;
-        Sleep(100);
+        Sleep(NODE_WORK_TICK);
         if (fRequestShutdown)
             Shutdown(NULL);
         vnThreadsRunning[2]++;
-        if (fShutdown)
-            return;
     }
+
+    // Let the workers see fShutdown
+    boost::lock_guard<boost::mutex> lock(mutexNodeWork);
+    condNodeWork.notify_all();
+}
+
+void static StartMessageWorkers(int nThreads)
+{
+    nThreads = max(1, min(nThreads, MAX_MESSAGE_THREADS));
+    int nStarted = 0;
+    for (int i = 0; i < nThreads; i++)
+    {
+        // Counted before the thread exists so StopNode can't miss it
+        {
+            boost::lock_guard<boost::mutex> lock(mutexNodeWork);
+            nMessageWorkersAlive++;
+        }
+        if (!CreateThread(ThreadMessageWorker, NULL))
+        {
+            printf("Error: CreateThread(ThreadMessageWorker) failed\n");
+            boost::lock_guard<boost::mutex> lock(mutexNodeWork);
+            nMessageWorkersAlive--;
+            break;
+        }
+        nStarted++;
+    }
+    printf("Using %d message worker threads\n", nStarted);
+}
+
+// Idle workers wait on condNodeWork, which exit() destroys, so StopNode
+// wakes them and waits until they have all returned, not just gone idle
+int static WakeMessageWorkers()
+{
+    boost::lock_guard<boost::mutex> lock(mutexNodeWork);
+    condNodeWork.notify_all();
+    return nMessageWorkersAlive;
 }
 
 
@@ -1663,6 +2306,7 @@ void StartNode(void* parg)
         printf("Error: CreateThread(ThreadOpenConnections) failed\n");
 
     // Process messages
+    StartMessageWorkers(GetArg("-messagethreads", 2));
     if (!CreateThread(ThreadMessageHandler, NULL))
         printf("Error: CreateThread(ThreadMessageHandler) failed\n");
 
@@ -1677,6 +2321,7 @@ bool StopNode()
     nTransactionsUpdated++;
     int64 nStart = GetTime();
     while (vnThreadsRunning[0] > 0 || vnThreadsRunning[2] > 0 || vnThreadsRunning[3] > 0 || vnThreadsRunning[4] > 0
+        || WakeMessageWorkers() > 0
 #ifdef USE_UPNP
         || vnThreadsRunning[5] > 0
 #endif
@@ -1692,7 +2337,8 @@ bool StopNode()
     if (vnThreadsRunning[3] > 0) printf("ThreadBitcoinMiner still running\n");
     if (vnThreadsRunning[4] > 0) printf("ThreadRPCServer still running\n");
     if (fHaveUPnP && vnThreadsRunning[5] > 0) printf("ThreadMapPort still running\n");
-    while (vnThreadsRunning[2] > 0 || vnThreadsRunning[4] > 0)
+    if (WakeMessageWorkers() > 0) printf("ThreadMessageWorker still running\n");
+    while (vnThreadsRunning[2] > 0 || vnThreadsRunning[4] > 0 || WakeMessageWorkers() > 0)
         Sleep(20);
     Sleep(50);
 
@@ -12,6 +12,12 @@
 #include <arpa/inet.h>
 #endif
 
+// Sockets are serviced by an edge triggered epoll reactor where available,
+// otherwise by polling with select()
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#endif
+
 class CMessageHeader;
 class CAddress;
 class CInv;
@@ -23,6 +29,7 @@ extern int nConnectTimeout;
 
 
 extern unsigned short GetDefaultPort();
+unsigned short GetListenPort();
 
 inline unsigned int ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer", 10*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 10*1000); }
@@ -50,6 +57,12 @@ void DNSAddressSeed();
 bool BindListenPort(std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+void WakeSocketHandler();
+void QueueNodeWork(CNode* pnode, bool fTrickle=false);
+void ScheduleNodeWork(CNode* pnode, int64 nTimeMillis);
+void RecordBlockRelayDelay(int64 nMicros);
+void GetMessageWorkStats(uint64& nRuns, int64& nWaitTotal, int64& nWaitMax, int64& nBusyTotal,
+                         uint64& nBlockRelays, int64& nBlockRelayTotal, int64& nBlockRelayMax);
 
 
 
@@ -143,6 +156,68 @@ public:
 
 
 
+//
+// A message as it comes off the wire.  The header is collected first, then
+// the payload is received into a stream of the announced size, so complete
+// messages can be handed to ProcessMessage without copying or searching.
+//
+class CNetMessage
+{
+public:
+    bool fInData;
+    CDataStream hdrbuf;
+    unsigned int nHdrPos;
+    CMessageHeader hdr;
+    CDataStream vRecv;
+    unsigned int nDataPos;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(::GetSerializeSize(CMessageHeader(), nTypeIn, nVersionIn));
+        fInData = false;
+        nHdrPos = 0;
+        nDataPos = 0;
+    }
+
+    bool IsComplete() const
+    {
+        return fInData && nDataPos == hdr.nMessageSize;
+    }
+
+    // Both return the number of bytes consumed, or -1 if the stream is bad
+    int ReadHeader(const char* pch, unsigned int nBytes);
+    int ReadData(const char* pch, unsigned int nBytes);
+
+    // Make room for up to nWant more payload bytes and return how many
+    // can be written at &vRecv[nDataPos]
+    unsigned int PrepareData(unsigned int nWant);
+};
+
+
+
+//
+// A finished message ready for the wire.  Buffers are never modified once
+// queued, so the same one can be queued to any number of peers.
+//
+typedef boost::shared_ptr<const CDataStream> SendBuffer;
+
+// Fill in the size and checksum of the message whose header starts at
+// nHeaderStart and whose payload runs from nMessageStart to the end
+void FinishMessageHeader(CDataStream& s, unsigned int nHeaderStart, unsigned int nMessageStart);
+
+template<typename T>
+SendBuffer MakeSendBuffer(const char* pszCommand, const T& a, int nVersion)
+{
+    boost::shared_ptr<CDataStream> ps(new CDataStream(SER_NETWORK, nVersion));
+    *ps << CMessageHeader(pszCommand, 0);
+    unsigned int nMessageStart = ps->size();
+    *ps << a;
+    FinishMessageHeader(*ps, 0, nMessageStart);
+    return ps;
+}
+
+
+
 
 
 
@@ -447,6 +522,71 @@ public:
 
 
 
+//
+// Hashed timer wheel.  Each slot holds the timers due on ticks congruent to
+// its index, so scheduling is constant time and advancing only visits the
+// slots for the ticks that passed.  Timers further out than one revolution
+// simply stay in their slot until their tick comes around.
+//
+template<typename T>
+class CTimerWheel
+{
+protected:
+    int64 nTickMillis;
+    int64 nCurrentTick;
+    std::vector<std::vector<std::pair<int64, T> > > vSlots;
+    unsigned int nSize;
+
+public:
+    CTimerWheel(int64 nTickMillisIn, unsigned int nSlots, int64 nNowMillis)
+    {
+        nTickMillis = nTickMillisIn;
+        nCurrentTick = nNowMillis / nTickMillis;
+        vSlots.resize(nSlots);
+        nSize = 0;
+    }
+
+    unsigned int size() const { return nSize; }
+    int64 GetTickMillis() const { return nTickMillis; }
+
+    // Times that are already due fire on the next tick
+    void Schedule(int64 nTimeMillis, const T& value)
+    {
+        int64 nTick = std::max((nTimeMillis + nTickMillis - 1) / nTickMillis, nCurrentTick + 1);
+        vSlots[nTick % vSlots.size()].push_back(std::make_pair(nTick, value));
+        nSize++;
+    }
+
+    // Move the wheel to nNowMillis and append everything that came due
+    void Advance(int64 nNowMillis, std::vector<T>& vExpired)
+    {
+        int64 nNowTick = nNowMillis / nTickMillis;
+        if (nNowTick <= nCurrentTick)
+            return;
+        int64 nTicks = std::min(nNowTick - nCurrentTick, (int64)vSlots.size());
+        for (int64 i = 1; i <= nTicks; i++)
+        {
+            std::vector<std::pair<int64, T> >& vSlot = vSlots[(nCurrentTick + i) % vSlots.size()];
+            for (unsigned int j = 0; j < vSlot.size(); )
+            {
+                if (vSlot[j].first <= nNowTick)
+                {
+                    vExpired.push_back(vSlot[j].second);
+                    vSlot[j] = vSlot.back();
+                    vSlot.pop_back();
+                    nSize--;
+                }
+                else
+                    j++;
+            }
+        }
+        nCurrentTick = nNowTick;
+    }
+};
+
+
+
+
 class CRequestTracker
 {
 public:
@@ -503,7 +643,12 @@ public:
     uint64 nServices;
     SOCKET hSocket;
     CDataStream vSend;
-    CDataStream vRecv;
+    std::deque<SendBuffer> vSendMsg;
+    unsigned int nSendOffset;
+    uint64 nSendSize;
+    std::list<CNetMessage> vRecvMsg;
+    unsigned int nRecvQueueSize;
+    int nRecvVersion;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     int64 nLastSend;
@@ -520,6 +665,22 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+
+    // reactor state: fPollRegistered and fPollSend are guarded by cs_vSend,
+    // fRecvReady, fSendReady and fPollReady (in the ready list) are only
+    // used by the socket thread
+    bool fPollRegistered;
+    bool fPollSend;
+    bool fRecvReady;
+    bool fSendReady;
+    bool fPollReady;
+
+    // message work queue state, guarded by mutexNodeWork in net.cpp
+    bool fWorkQueued;
+    bool fWorkRunning;
+    bool fWorkPending;
+    bool fWorkTrickle;
+    int64 nWorkQueuedTime;
 protected:
     int nRefCount;
 public:
@@ -529,6 +690,7 @@ public:
     uint256 hashContinue;
     CBlockIndex* pindexLastGetBlocksBegin;
     uint256 hashLastGetBlocksEnd;
+    int64 nLastGetBlocksTime;
     int nStartingHeight;
 
     // flood relay
@@ -542,6 +704,7 @@ public:
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
+    int64 nBlockInventoryTime;
 
     // publish and subscription
     std::vector<char> vfSubscribe;
@@ -553,13 +716,15 @@ public:
         hSocket = hSocketIn;
         vSend.SetType(SER_NETWORK);
         vSend.SetVersion(0);
-        vRecv.SetType(SER_NETWORK);
-        vRecv.SetVersion(0);
+        nSendOffset = 0;
+        nSendSize = 0;
+        nRecvQueueSize = 0;
+        nRecvVersion = 0;
         // Version 0.2 obsoletes 20 Feb 2012
         if (GetTime() > 1329696000)
         {
             vSend.SetVersion(209);
-            vRecv.SetVersion(209);
+            nRecvVersion = 209;
         }
         nLastSend = 0;
         nLastRecv = 0;
@@ -575,13 +740,25 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fPollRegistered = false;
+        fPollSend = false;
+        fRecvReady = false;
+        fSendReady = false;
+        fPollReady = false;
+        fWorkQueued = false;
+        fWorkRunning = false;
+        fWorkPending = false;
+        fWorkTrickle = false;
+        nWorkQueuedTime = 0;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
+        nLastGetBlocksTime = 0;
         nStartingHeight = -1;
         fGetAddr = false;
+        nBlockInventoryTime = 0;
         vfSubscribe.assign(256, false);
 
         // Be shy and don't send version until we hear
@@ -604,6 +781,19 @@ private:
 public:
 
 
+    // Complete messages waiting for a worker past this size make the socket
+    // thread stop reading from the peer, cs_vRecv must be held
+    bool IsRecvPaused() const
+    {
+        return nRecvQueueSize > ReceiveBufferSize();
+    }
+
+    void SetRecvVersion(int nVersionIn)
+    {
+        CRITICAL_BLOCK(cs_vRecv)
+            nRecvVersion = nVersionIn;
+    }
+
     int GetRefCount()
     {
         return std::max(nRefCount, 0) + (GetTime() < nReleaseTime ? 1 : 0);
@@ -648,9 +838,21 @@ public:
 
     void PushInventory(const CInv& inv)
     {
+        bool fNew = false;
         CRITICAL_BLOCK(cs_inventory)
+        {
             if (!setInventoryKnown.count(inv))
+            {
+                if (inv.type == MSG_BLOCK && nBlockInventoryTime == 0)
+                    nBlockInventoryTime = GetTimeMicros();
                 vInventoryToSend.push_back(inv);
+                fNew = true;
+            }
+        }
+
+        // Have the message workers announce it rather than waiting for a poll
+        if (fNew)
+            QueueNodeWork(this);
     }
 
     void AskFor(const CInv& inv)
@@ -668,6 +870,11 @@ public:
         // Each retry is 2 minutes after the last
         nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
         mapAskFor.insert(std::make_pair(nRequestTime, inv));
+
+        // Requests that are due now go out after the current message,
+        // later retries need a timer
+        if (nRequestTime > GetTime() * 1000000)
+            ScheduleNodeWork(this, nRequestTime / 1000);
     }
 
 
@@ -708,28 +915,41 @@ public:
         if (nHeaderStart == -1)
             return;
 
-        // Set the size
-        unsigned int nSize = vSend.size() - nMessageStart;
-        memcpy((char*)&vSend[nHeaderStart] + offsetof(CMessageHeader, nMessageSize), &nSize, sizeof(nSize));
-
-        // Set the checksum
-        if (vSend.GetVersion() >= 209)
-        {
-            uint256 hash = Hash(vSend.begin() + nMessageStart, vSend.end());
-            unsigned int nChecksum = 0;
-            memcpy(&nChecksum, &hash, sizeof(nChecksum));
-            assert(nMessageStart - nHeaderStart >= offsetof(CMessageHeader, nChecksum) + sizeof(nChecksum));
-            memcpy((char*)&vSend[nHeaderStart] + offsetof(CMessageHeader, nChecksum), &nChecksum, sizeof(nChecksum));
-        }
-
-        printf("(%d bytes) ", nSize);
+        FinishMessageHeader(vSend, nHeaderStart, nMessageStart);
+        printf("(%d bytes) ", vSend.size() - nMessageStart);
         printf("\n");
 
+        // vSend only ever holds the message being built, it is handed
+        // over to the send queue as it is
+        boost::shared_ptr<CDataStream> ps(new CDataStream(vSend.nType, vSend.nVersion));
+        ps->swap(vSend);
+        QueueSendBuffer(ps);
+
         nHeaderStart = -1;
         nMessageStart = -1;
         cs_vSend.Leave();
     }
 
+    // Queue an already serialized message, see MakeSendBuffer
+    void PushSendBuffer(const char* pszCommand, const SendBuffer& buf)
+    {
+        CRITICAL_BLOCK(cs_vSend)
+        {
+            if (fDebug)
+                printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
+            printf("sending: %s (%d bytes) (shared)\n", pszCommand, buf->size());
+            QueueSendBuffer(buf);
+        }
+    }
+
+    // cs_vSend must be held
+    void QueueSendBuffer(const SendBuffer& buf)
+    {
+        vSendMsg.push_back(buf);
+        nSendSize += buf->size();
+        NotifySend();
+    }
+
     void EndMessageAbortIfEmpty()
     {
         if (nHeaderStart == -1)
@@ -962,6 +1182,7 @@ public:
     void CancelSubscribe(unsigned int nChannel);
     void CloseSocketDisconnect();
     void Cleanup();
+    void NotifySend();
 };
 
 
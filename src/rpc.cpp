@@ -282,36 +282,527 @@ Value getblockbycount(const Array& params, bool fHelp)
             "Dumps the block existing at specified height");
 
     int64 height = params[0].get_int64();
-    if (height > nBestHeight)
+    CBlockIndex* pindex = NULL;
+    CRITICAL_BLOCK(cs_main)
+    {
+        if (height > nBestHeight)
+            throw runtime_error(
+                "getblockbycount height\n"
+                "Dumps the block existing at specified height");
+
+        pindex = GetActiveChainBlock(height);
+    }
+    if (!pindex)
         throw runtime_error(
             "getblockbycount height\n"
             "Dumps the block existing at specified height");
 
-    string blkname = strprintf("blk%d", height);
+    CBlock block;
+    block.ReadFromDisk(pindex);
+    block.BuildMerkleTree();
 
-    CBlockIndex* pindex;
-    bool found = false;
+    return BlockToValue(block);
+}
+
+
+Value getblockindexinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockindexinfo\n"
+            "Returns the size of the in-memory block index and its auxpow cache.");
+
+    int nAuxPowCached;
+    uint64 nHits, nMisses;
+    GetAuxPowCacheStats(nAuxPowCached, nHits, nMisses);
+
+    int nEntries;
+    CRITICAL_BLOCK(cs_main)
+        nEntries = mapBlockIndex.size();
+
+    Object result;
+    result.push_back(Pair("entries", nEntries));
+    result.push_back(Pair("entrybytes", (int)sizeof(CBlockIndex)));
+    result.push_back(Pair("auxpowcached", nAuxPowCached));
+    result.push_back(Pair("auxpowhits", (boost::int64_t)nHits));
+    result.push_back(Pair("auxpowmisses", (boost::int64_t)nMisses));
+    return result;
+}
+
+
+Object OrphanPoolStatsToValue(const COrphanPoolStats& stats)
+{
+    Object result;
+    result.push_back(Pair("count", stats.nCount));
+    result.push_back(Pair("size", (boost::int64_t)stats.nSize));
+    result.push_back(Pair("maxsize", (boost::int64_t)stats.nMaxSize));
+    result.push_back(Pair("peers", stats.nPeers));
+    result.push_back(Pair("evicted", (boost::int64_t)stats.nEvicted));
+    result.push_back(Pair("rejected", (boost::int64_t)stats.nRejected));
+    return result;
+}
+
+Value getorphaninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getorphaninfo\n"
+            "Returns the number and size of the orphan blocks and transactions held,\n"
+            "the peers they came from, and how many were evicted to stay within the\n"
+            "size limits or rejected as too large.");
 
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin();
-         mi != mapBlockIndex.end(); ++mi)
+    COrphanPoolStats blocks, transactions;
+    GetOrphanPoolStats(blocks, transactions);
+
+    Object result;
+    result.push_back(Pair("blocks", OrphanPoolStatsToValue(blocks)));
+    result.push_back(Pair("transactions", OrphanPoolStatsToValue(transactions)));
+    return result;
+}
+
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns statistics of the cache of verified signatures.");
+
+    unsigned int nSize, nMaxSize;
+    uint64 nHits, nMisses;
+    GetSignatureCacheStats(nSize, nMaxSize, nHits, nMisses);
+
+    Object result;
+    result.push_back(Pair("size", (int)nSize));
+    result.push_back(Pair("maxsize", (int)nMaxSize));
+    result.push_back(Pair("hits", (boost::int64_t)nHits));
+    result.push_back(Pair("misses", (boost::int64_t)nMisses));
+    result.push_back(Pair("hitrate", nHits + nMisses > 0 ? (double)nHits / (nHits + nMisses) : 0.0));
+    return result;
+}
+
+
+Value getrelayinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrelayinfo\n"
+            "Returns how long peers with complete messages waited for a message worker,\n"
+            "how long the workers spent on them and how long relayed blocks waited to be\n"
+            "announced to each peer, in microseconds.  Adding up the wait and block\n"
+            "figures of each node along a chain of connected nodes gives the delay the\n"
+            "message handling adds to every hop.");
+
+    uint64 nRuns, nBlockRelays;
+    int64 nWaitTotal, nWaitMax, nBusyTotal, nBlockRelayTotal, nBlockRelayMax;
+    GetMessageWorkStats(nRuns, nWaitTotal, nWaitMax, nBusyTotal, nBlockRelays, nBlockRelayTotal, nBlockRelayMax);
+
+    Object result;
+    result.push_back(Pair("runs", (boost::int64_t)nRuns));
+    result.push_back(Pair("waitavgus", nRuns > 0 ? (boost::int64_t)(nWaitTotal / nRuns) : 0));
+    result.push_back(Pair("waitmaxus", (boost::int64_t)nWaitMax));
+    result.push_back(Pair("busyavgus", nRuns > 0 ? (boost::int64_t)(nBusyTotal / nRuns) : 0));
+    result.push_back(Pair("blockrelays", (boost::int64_t)nBlockRelays));
+    result.push_back(Pair("blockrelayavgus", nBlockRelays > 0 ? (boost::int64_t)(nBlockRelayTotal / nBlockRelays) : 0));
+    result.push_back(Pair("blockrelaymaxus", (boost::int64_t)nBlockRelayMax));
+    return result;
+}
+
+
+Value getblockdownloadinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockdownloadinfo\n"
+            "Returns the number of announced blocks waiting to be downloaded, the number\n"
+            "of block requests in flight and how many were sent again to a faster peer,\n"
+            "and for each peer blocks are downloaded from, its requests in flight and\n"
+            "their limit, the blocks received, the average response time in microseconds\n"
+            "and how often it stalled.");
+
+    unsigned int nQueued, nInFlight;
+    uint64 nRerequested;
+    vector<CBlockDownloadPeerStats> vPeers;
+    GetBlockDownloadStats(nQueued, nInFlight, nRerequested, vPeers);
+
+    Array peers;
+    BOOST_FOREACH(const CBlockDownloadPeerStats& stats, vPeers)
     {
-    	pindex = (*mi).second;
-	if ((pindex->nHeight == height) && (pindex->IsInMainChain())) {
-		found = true;
-		break;
-	}
+        Object peer;
+        peer.push_back(Pair("addr", stats.strAddr));
+        peer.push_back(Pair("inflight", stats.nInFlight));
+        peer.push_back(Pair("maxinflight", stats.nMaxInFlight));
+        peer.push_back(Pair("received", (boost::int64_t)stats.nReceived));
+        peer.push_back(Pair("avgresponseus", (boost::int64_t)stats.nAvgResponse));
+        peer.push_back(Pair("stalls", stats.nStalls));
+        peers.push_back(peer);
+    }
+
+    Object result;
+    result.push_back(Pair("queued", (int)nQueued));
+    result.push_back(Pair("inflight", (int)nInFlight));
+    result.push_back(Pair("rerequested", (boost::int64_t)nRerequested));
+    result.push_back(Pair("peers", peers));
+    return result;
+}
+
+
+Value benchsignatures(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "benchsignatures <firstheight> [lastheight]\n"
+            "Verifies the input signatures of the given range of main chain blocks,\n"
+            "once on this thread and once on the signature verification threads (-par),\n"
+            "both bypassing the signature cache, then once more with the cache warm as\n"
+            "it is for blocks whose transactions were already in the memory pool.");
+
+    int nFirst = params[0].get_int();
+    int nLast = (params.size() > 1 ? params[1].get_int() : nBestHeight);
+
+    vector<CBlockIndex*> vBlocks;
+    CRITICAL_BLOCK(cs_main)
+    {
+        if (nFirst < 0 || nFirst > nLast || nLast > nBestHeight)
+            throw JSONRPCError(-8, "Block height out of range");
+        vBlocks.assign(vActiveChain.begin() + nFirst, vActiveChain.begin() + nLast + 1);
     }
 
-    if (!found)
+    CTxDB txdb("r");
+    int nChecks = 0;
+    int64 nSerialTime = 0;
+    int64 nParallelTime = 0;
+    int64 nCachedTime = 0;
+    BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            throw JSONRPCError(-5, "Block not found on disk");
+
+        vector<CSignatureCheck> vChecks;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            if (tx.IsCoinBase())
+                continue;
+            for (int i = 0; i < tx.vin.size(); i++)
+            {
+                CTransaction txPrev;
+                CTxIndex txindex;
+                if (!txPrev.ReadFromDisk(txdb, tx.vin[i].prevout, txindex))
+                    throw JSONRPCError(-5, "Previous transaction not found on disk");
+                vChecks.push_back(CSignatureCheck(txPrev.vout[tx.vin[i].prevout.n].scriptPubKey, tx, i));
+            }
+        }
+        nChecks += vChecks.size();
+
+        // The node's own cache is left alone, the cold runs just don't use it
+        bool fValid = true;
+        SetSignatureCacheBypass(true);
+        int64 nStart = GetTimeMillis();
+        BOOST_FOREACH(const CSignatureCheck& check, vChecks)
+            if (fValid && !check.Verify())
+                fValid = false;
+        nSerialTime += GetTimeMillis() - nStart;
+
+        nStart = GetTimeMillis();
+        if (fValid && !VerifySignatureChecks(vChecks))
+            fValid = false;
+        nParallelTime += GetTimeMillis() - nStart;
+        SetSignatureCacheBypass(false);
+        if (!fValid)
+            throw JSONRPCError(-1, "Signature verification failed");
+
+        // Warm the cache the way the memory pool would
+        if (!VerifySignatureChecks(vChecks))
+            throw JSONRPCError(-1, "Signature verification failed");
+        nStart = GetTimeMillis();
+        if (!VerifySignatureChecks(vChecks))
+            throw JSONRPCError(-1, "Signature verification failed");
+        nCachedTime += GetTimeMillis() - nStart;
+    }
+
+    Object result;
+    result.push_back(Pair("blocks", (int)vBlocks.size()));
+    result.push_back(Pair("signatures", nChecks));
+    result.push_back(Pair("threads", nSignatureCheckThreads + 1));
+    result.push_back(Pair("serialms", (boost::int64_t)nSerialTime));
+    result.push_back(Pair("parallelms", (boost::int64_t)nParallelTime));
+    result.push_back(Pair("cachedms", (boost::int64_t)nCachedTime));
+    return result;
+}
+
+
+Value benchtxheights(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getblockbycount height\n"
-            "Dumps the block existing at specified height");
+            "benchtxheights [blocks=1000]\n"
+            "Looks up the block index entry of every transaction in the last <blocks> blocks,\n"
+            "once by reading and hashing the block header and once by disk position.");
 
-    CBlock block;
-    block.ReadFromDisk(pindex);
-    block.BuildMerkleTree();
+    int nBlocks = (params.size() > 0 ? params[0].get_int() : 1000);
 
-    return BlockToValue(block);
+    vector<CDiskTxPos> vTxPos;
+    CRITICAL_BLOCK(cs_main)
+    {
+        CTxDB txdb("r");
+        for (CBlockIndex* pindex = pindexBest; pindex && nBlocks-- > 0; pindex = pindex->pprev)
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(pindex))
+                throw JSONRPCError(-5, "Block not found on disk");
+            BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            {
+                CTxIndex txindex;
+                if (txdb.ReadTxIndex(tx.GetHash(), txindex))
+                    vTxPos.push_back(txindex.pos);
+            }
+        }
+    }
+
+    int64 nHeaderTime, nPosTime;
+    CRITICAL_BLOCK(cs_main)
+    {
+        int64 nStart = GetTimeMillis();
+        BOOST_FOREACH(const CDiskTxPos& pos, vTxPos)
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false) || !mapBlockIndex.count(block.GetHash()))
+                throw JSONRPCError(-5, "Block index entry not found");
+        }
+        nHeaderTime = GetTimeMillis() - nStart;
+
+        nStart = GetTimeMillis();
+        BOOST_FOREACH(const CDiskTxPos& pos, vTxPos)
+            if (!GetBlockIndexAtPos(pos.nFile, pos.nBlockPos))
+                throw JSONRPCError(-5, "Block index entry not found");
+        nPosTime = GetTimeMillis() - nStart;
+    }
+
+    Object result;
+    result.push_back(Pair("lookups", (int)vTxPos.size()));
+    result.push_back(Pair("headerms", (boost::int64_t)nHeaderTime));
+    result.push_back(Pair("positionms", (boost::int64_t)nPosTime));
+    return result;
+}
+
+Value benchblockindex(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "benchblockindex [lookups=1000000]\n"
+            "Looks up <lookups> random block hashes, half of them unknown, in mapBlockIndex\n"
+            "and in an ordered map of the same entries, and reports block index memory use.");
+
+    int nLookups = (params.size() > 0 ? params[0].get_int() : 1000000);
+    if (nLookups < 1 || nLookups > 100000000)
+        throw JSONRPCError(-8, "lookups must be between 1 and 100000000");
+
+    vector<uint256> vHashes;
+    map<uint256, CBlockIndex*> mapOrdered;
+    int nChunks;
+    uint64 nArenaBytes;
+    CRITICAL_BLOCK(cs_main)
+    {
+        if (mapBlockIndex.empty())
+            throw JSONRPCError(-1, "Block index is empty");
+        vector<uint256> vKnown;
+        vKnown.reserve(mapBlockIndex.size());
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        {
+            vKnown.push_back((*mi).first);
+            mapOrdered.insert(*mi);
+        }
+        vHashes.reserve(nLookups);
+        for (int i = 0; i < nLookups; i++)
+        {
+            if (i & 1)
+                vHashes.push_back(Hash(BEGIN(i), END(i)));
+            else
+                vHashes.push_back(vKnown[GetRand(vKnown.size())]);
+        }
+        GetBlockIndexArenaStats(nChunks, nArenaBytes);
+    }
+
+    int nFound = 0;
+    int64 nStart = GetTimeMillis();
+    CRITICAL_BLOCK(cs_main)
+    {
+        BOOST_FOREACH(const uint256& hash, vHashes)
+            nFound += mapBlockIndex.count(hash);
+    }
+    int64 nHashTime = GetTimeMillis() - nStart;
+
+    int nFoundOrdered = 0;
+    nStart = GetTimeMillis();
+    BOOST_FOREACH(const uint256& hash, vHashes)
+        nFoundOrdered += mapOrdered.count(hash);
+    int64 nOrderedTime = GetTimeMillis() - nStart;
+
+    if (nFound != nFoundOrdered)
+        throw JSONRPCError(-1, "Lookup results differ");
+
+    Object result;
+    result.push_back(Pair("entries", (int)mapOrdered.size()));
+    result.push_back(Pair("lookups", nLookups));
+    result.push_back(Pair("found", nFound));
+    result.push_back(Pair("hashms", (boost::int64_t)nHashTime));
+    result.push_back(Pair("orderedms", (boost::int64_t)nOrderedTime));
+    result.push_back(Pair("arenachunks", nChunks));
+    result.push_back(Pair("arenabytes", (boost::int64_t)nArenaBytes));
+#ifndef __WXMSW__
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        result.push_back(Pair("maxrsskb", (boost::int64_t)usage.ru_maxrss));
+#endif
+    return result;
+}
+
+#ifndef __WXMSW__
+// User plus system CPU time of this process in microseconds
+static int64 GetProcessCPUTime()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return (int64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+#endif
+
+Value benchconnections(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "benchconnections <count> [seconds=10]\n"
+            "Measures the CPU time this process uses over <seconds> with no extra\n"
+            "connections and then with <count> idle loopback connections to our own\n"
+            "listening port.  Raise -maxconnections to test large counts.");
+
+#ifdef __WXMSW__
+    throw JSONRPCError(-1, "Not supported on this platform");
+#else
+    int nCount = params[0].get_int();
+    int nSeconds = (params.size() > 1 ? params[1].get_int() : 10);
+    if (nCount < 1 || nSeconds < 1 || nSeconds > 50)
+        throw JSONRPCError(-8, "count must be positive and seconds between 1 and 50");
+    if (hListenSocket == INVALID_SOCKET)
+        throw JSONRPCError(-1, "Not listening for connections");
+
+    int64 nCPUStart = GetProcessCPUTime();
+    Sleep(nSeconds * 1000);
+    int64 nCPUBaseline = GetProcessCPUTime() - nCPUStart;
+
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = htons(GetListenPort());
+    vector<SOCKET> vSockets;
+    for (int i = 0; i < nCount; i++)
+    {
+        SOCKET hSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (hSocket == INVALID_SOCKET)
+            break;
+        if (connect(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR)
+        {
+            closesocket(hSocket);
+            break;
+        }
+        vSockets.push_back(hSocket);
+    }
+
+    // Give the socket thread a moment to accept them
+    Sleep(1000);
+    int nAccepted = 0;
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound && pnode->addr.ip == sockaddr.sin_addr.s_addr)
+                nAccepted++;
+    }
+
+    nCPUStart = GetProcessCPUTime();
+    Sleep(nSeconds * 1000);
+    int64 nCPUConnected = GetProcessCPUTime() - nCPUStart;
+
+    BOOST_FOREACH(SOCKET hSocket, vSockets)
+        closesocket(hSocket);
+
+    Object result;
+    result.push_back(Pair("connections", (int)vSockets.size()));
+    result.push_back(Pair("accepted", nAccepted));
+    result.push_back(Pair("seconds", nSeconds));
+    result.push_back(Pair("baselinecpums", (boost::int64_t)(nCPUBaseline / 1000)));
+    result.push_back(Pair("connectedcpums", (boost::int64_t)(nCPUConnected / 1000)));
+    if (nAccepted > 0)
+        result.push_back(Pair("cpuuspersecondperconnection", (double)(nCPUConnected - nCPUBaseline) / nSeconds / nAccepted));
+    return result;
+#endif
+}
+
+Value benchchainwork(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "benchchainwork [blocks=0]\n"
+            "Recomputes the chain work and proof of work targets of the last <blocks> blocks\n"
+            "(0 for the whole main chain), once with CBigNum and once with uint256.");
+
+    int nBlocks = (params.size() > 0 ? params[0].get_int() : 0);
+
+    vector<pair<uint256, unsigned int> > vHeaders;
+    CRITICAL_BLOCK(cs_main)
+    {
+        int nStartHeight = (nBlocks > 0 ? max(0, nBestHeight - nBlocks + 1) : 0);
+        for (int nHeight = nStartHeight; nHeight <= nBestHeight; nHeight++)
+        {
+            CBlockIndex* pindex = GetActiveChainBlock(nHeight);
+            if (pindex)
+                vHeaders.push_back(make_pair(pindex->GetBlockHash(), pindex->nBits));
+        }
+    }
+
+    int64 nStart = GetTimeMillis();
+    CBigNum bnWork = 0;
+    int nBigNumValid = 0;
+    for (int i = 0; i < vHeaders.size(); i++)
+    {
+        CBigNum bnTarget;
+        bnTarget.SetCompact(vHeaders[i].second);
+        if (bnTarget <= 0)
+            continue;
+        bnWork += (CBigNum(1)<<256) / (bnTarget+1);
+        if (vHeaders[i].first <= bnTarget.getuint256())
+            nBigNumValid++;
+    }
+    int64 nBigNumTime = GetTimeMillis() - nStart;
+
+    nStart = GetTimeMillis();
+    uint256 nWork = 0;
+    int nUint256Valid = 0;
+    for (int i = 0; i < vHeaders.size(); i++)
+    {
+        bool fNegative;
+        bool fOverflow;
+        uint256 nTarget;
+        nTarget.SetCompact(vHeaders[i].second, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || nTarget == 0)
+            continue;
+        nWork += (~nTarget / (nTarget + 1)) + 1;
+        if (vHeaders[i].first <= nTarget)
+            nUint256Valid++;
+    }
+    int64 nUint256Time = GetTimeMillis() - nStart;
+
+    if (bnWork.getuint256() != nWork || nBigNumValid != nUint256Valid)
+        throw JSONRPCError(-1, "CBigNum and uint256 results differ");
+
+    Object result;
+    result.push_back(Pair("blocks", (int)vHeaders.size()));
+    result.push_back(Pair("chainwork", nWork.GetHex()));
+    result.push_back(Pair("bignumms", (boost::int64_t)nBigNumTime));
+    result.push_back(Pair("uint256ms", (boost::int64_t)nUint256Time));
+    return result;
 }
 
 
@@ -325,12 +816,16 @@ Value getblockbyhash(const Array& params, bool fHelp)
     uint256 hash;
     hash.SetHex(params[0].get_str());
 
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
-    if (mi == mapBlockIndex.end())
+    CBlockIndex* pindex = NULL;
+    CRITICAL_BLOCK(cs_main)
+    {
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi != mapBlockIndex.end())
+            pindex = (*mi).second;
+    }
+    if (!pindex)
         throw JSONRPCError(-18, "hash not found");
 
-    CBlockIndex* pindex = (*mi).second;
-
     CBlock block;
     block.ReadFromDisk(pindex);
     block.BuildMerkleTree();
@@ -726,6 +1221,7 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
 
     // Tally
     int64 nAmount = 0;
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
@@ -785,6 +1281,7 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 
     // Tally
     int64 nAmount = 0;
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
@@ -807,6 +1304,7 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 int64 GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMinDepth)
 {
     int64 nBalance = 0;
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         // Tally wallet transactions
@@ -858,6 +1356,8 @@ Value getbalance(const Array& params, bool fHelp)
         // (GetBalance() sums up all unspent TxOuts)
         // getbalance and getbalance '*' should always return the same number.
         int64 nBalance = 0;
+        CRITICAL_BLOCK(cs_main)
+        CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
         for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
         {
             const CWalletTx& wtx = (*it).second;
@@ -906,6 +1406,7 @@ Value movecmd(const Array& params, bool fHelp)
     if (params.size() > 4)
         strComment = params[4].get_str();
 
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         CWalletDB walletdb(pwalletMain->strWalletFile);
@@ -1066,6 +1567,7 @@ Value ListReceived(const Array& params, bool fByAccounts)
 
     // Tally
     map<uint160, tallyitem> mapTally;
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
@@ -1293,6 +1795,7 @@ Value listtransactions(const Array& params, bool fHelp)
     Array ret;
     CWalletDB walletdb(pwalletMain->strWalletFile);
 
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         // Firs: get all CWalletTx and CAccountingEntry into a sorted-by-time multimap:
@@ -1352,6 +1855,7 @@ Value listaccounts(const Array& params, bool fHelp)
         nMinDepth = params[0].get_int();
 
     map<string, int64> mapAccountBalances;
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     CRITICAL_BLOCK(pwalletMain->cs_mapAddressBook)
     {
@@ -1407,6 +1911,7 @@ Value gettransaction(const Array& params, bool fHelp)
     hash.SetHex(params[0].get_str());
 
     Object entry;
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         if (!pwalletMain->mapWallet.count(hash))
@@ -1477,6 +1982,59 @@ Value validateaddress(const Array& params, bool fHelp)
 }
 
 
+// Block template shared by getwork, getworkaux and getauxblock.  Only the
+// latest is kept, the RPCs copy the block out of it before handing out work.
+static CBlockTemplate* pblockTemplate = NULL;
+static unsigned int nBlockTemplateSerial = 0;
+
+CReserveKey& GetBlockTemplateReserveKey()
+{
+    static CReserveKey reservekey(pwalletMain);
+    return reservekey;
+}
+
+CBlockTemplate* GetBlockTemplate()
+{
+    static unsigned int nTransactionsUpdatedLast;
+    static int64 nStart;
+    static bool fStale;
+
+    bool fNewTip = (!pblockTemplate || pblockTemplate->pindexPrev != pindexBest);
+
+    if (!fNewTip && nTransactionsUpdated != nTransactionsUpdatedLast)
+    {
+        // Append new memory pool transactions to the template
+        nTransactionsUpdatedLast = nTransactionsUpdated;
+        bool fAdded;
+        if (!pblockTemplate->AddTransactions(fAdded))
+            fStale = true;
+        if (fAdded)
+            pblockTemplate->nSerial = ++nBlockTemplateSerial;
+    }
+
+    // Full assembly on a new best block, or when transactions of the template
+    // left the memory pool (at most once a minute, as before)
+    if (fNewTip || (fStale && GetTime() - nStart > 60))
+    {
+        nTransactionsUpdatedLast = nTransactionsUpdated;
+        nStart = GetTime();
+        fStale = false;
+
+        CBlockTemplate* ptemplate = new CBlockTemplate();
+        CBlock* pblock = CreateNewBlock(GetBlockTemplateReserveKey(), ptemplate);
+        if (!pblock)
+        {
+            delete ptemplate;
+            throw JSONRPCError(-7, "Out of memory");
+        }
+        delete pblock;
+        ptemplate->nSerial = ++nBlockTemplateSerial;
+        delete pblockTemplate;
+        pblockTemplate = ptemplate;
+    }
+    return pblockTemplate;
+}
+
 Value getwork(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -1497,19 +2055,19 @@ Value getwork(const Array& params, bool fHelp)
 
     static map<uint256, pair<CBlock*, unsigned int> > mapNewBlock;
     static vector<CBlock*> vNewBlock;
-    static CReserveKey reservekey(pwalletMain);
+    CReserveKey& reservekey = GetBlockTemplateReserveKey();
 
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        static unsigned int nSerialLast;
         static CBlockIndex* pindexPrev;
-        static int64 nStart;
         static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        static vector<uint256> vCoinbaseBranch;
+        CBlockTemplate* ptemplate = GetBlockTemplate();
+        if (ptemplate->nSerial != nSerialLast)
         {
-            if (pindexPrev != pindexBest)
+            if (pindexPrev != ptemplate->pindexPrev)
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -1517,14 +2075,12 @@ Value getwork(const Array& params, bool fHelp)
                     delete pblock;
                 vNewBlock.clear();
             }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
-            nStart = GetTime();
+            nSerialLast = ptemplate->nSerial;
+            pindexPrev = ptemplate->pindexPrev;
+            vCoinbaseBranch = ptemplate->vCoinbaseBranch;
 
-            // Create new block
-            pblock = CreateNewBlock(reservekey);
-            if (!pblock)
-                throw JSONRPCError(-7, "Out of memory");
+            // Our own copy of the template, the header and coinbase are changed below
+            pblock = new CBlock(ptemplate->block);
             vNewBlock.push_back(pblock);
         }
 
@@ -1535,7 +2091,7 @@ Value getwork(const Array& params, bool fHelp)
         // Update nExtraNonce
         static unsigned int nExtraNonce = 0;
         static int64 nPrevTime = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce, nPrevTime);
+        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce, nPrevTime, &vCoinbaseBranch);
 
         // Save
         mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, nExtraNonce);
@@ -1546,7 +2102,7 @@ Value getwork(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate))));
@@ -1614,7 +2170,7 @@ Value getworkaux(const Array& params, bool fHelp)
 
     static map<uint256, pair<CBlock*, unsigned int> > mapNewBlock;
     static vector<CBlock*> vNewBlock;
-    static CReserveKey reservekey(pwalletMain);
+    CReserveKey& reservekey = GetBlockTemplateReserveKey();
 
     if (params.size() == 1)
     {
@@ -1622,15 +2178,14 @@ Value getworkaux(const Array& params, bool fHelp)
         vector<unsigned char> vchAux = ParseHex(params[0].get_str());
 
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        static unsigned int nSerialLast;
         static CBlockIndex* pindexPrev;
-        static int64 nStart;
         static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            vchAux != vchAuxPrev ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        static vector<uint256> vCoinbaseBranch;
+        CBlockTemplate* ptemplate = GetBlockTemplate();
+        if (ptemplate->nSerial != nSerialLast || vchAux != vchAuxPrev)
         {
-            if (pindexPrev != pindexBest)
+            if (pindexPrev != ptemplate->pindexPrev)
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -1638,15 +2193,13 @@ Value getworkaux(const Array& params, bool fHelp)
                     delete pblock;
                 vNewBlock.clear();
             }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
+            nSerialLast = ptemplate->nSerial;
+            pindexPrev = ptemplate->pindexPrev;
             vchAuxPrev = vchAux;
-            nStart = GetTime();
+            vCoinbaseBranch = ptemplate->vCoinbaseBranch;
 
-            // Create new block
-            pblock = CreateNewBlock(reservekey);
-            if (!pblock)
-                throw JSONRPCError(-7, "Out of memory");
+            // Our own copy of the template, the header and coinbase are changed below
+            pblock = new CBlock(ptemplate->block);
             vNewBlock.push_back(pblock);
         }
 
@@ -1657,7 +2210,7 @@ Value getworkaux(const Array& params, bool fHelp)
         // Update nExtraNonce
         static unsigned int nExtraNonce = 0;
         static int64 nPrevTime = 0;
-        IncrementExtraNonceWithAux(pblock, pindexPrev, nExtraNonce, nPrevTime, vchAux);
+        IncrementExtraNonceWithAux(pblock, pindexPrev, nExtraNonce, nPrevTime, vchAux, &vCoinbaseBranch);
 
         // Save
         mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, nExtraNonce);
@@ -1668,7 +2221,7 @@ Value getworkaux(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate))));
@@ -1862,19 +2415,18 @@ Value getauxblock(const Array& params, bool fHelp)
 
     static map<uint256, CBlock*> mapNewBlock;
     static vector<CBlock*> vNewBlock;
-    static CReserveKey reservekey(pwalletMain);
+    CReserveKey& reservekey = GetBlockTemplateReserveKey();
 
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        static unsigned int nSerialLast;
         static CBlockIndex* pindexPrev;
-        static int64 nStart;
         static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        CBlockTemplate* ptemplate = GetBlockTemplate();
+        if (ptemplate->nSerial != nSerialLast)
         {
-            if (pindexPrev != pindexBest)
+            if (pindexPrev != ptemplate->pindexPrev)
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -1882,33 +2434,28 @@ Value getauxblock(const Array& params, bool fHelp)
                     delete pblock;
                 vNewBlock.clear();
             }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
-            nStart = GetTime();
+            nSerialLast = ptemplate->nSerial;
+            pindexPrev = ptemplate->pindexPrev;
 
-            // Create new block with nonce = 0 and extraNonce = 1
-            pblock = CreateNewBlock(reservekey);
+            // Our own copy of the template with nonce = 0 and extraNonce = 1
+            pblock = new CBlock(ptemplate->block);
 
             // Update nTime
             pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
             pblock->nNonce = 0;
 
             // Push OP_2 just in case we want versioning later
-            pblock->vtx[0].vin[0].scriptSig = CScript() << pblock->nBits << CBigNum(1) << OP_2;
-            pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+            SetCoinbaseScript(pblock, CScript() << pblock->nBits << CBigNum(1) << OP_2, &ptemplate->vCoinbaseBranch);
 
             // Sets the version
             pblock->SetAuxPow(new CAuxPow());
 
             // Save
             mapNewBlock[pblock->GetHash()] = pblock;
-
-            if (!pblock)
-                throw JSONRPCError(-7, "Out of memory");
             vNewBlock.push_back(pblock);
         }
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
@@ -2025,6 +2572,11 @@ pair<string, rpcfn_type> pCallTable[] =
     make_pair("help",                  &help),
     make_pair("stop",                  &stop),
     make_pair("getblockbycount",       &getblockbycount),
+    make_pair("getblockindexinfo",     &getblockindexinfo),
+    make_pair("getsigcacheinfo",       &getsigcacheinfo),
+    make_pair("getorphaninfo",         &getorphaninfo),
+    make_pair("getrelayinfo",          &getrelayinfo),
+    make_pair("getblockdownloadinfo",  &getblockdownloadinfo),
     make_pair("getblockbyhash",        &getblockbyhash),
     make_pair("getblockcount",         &getblockcount),
     make_pair("getblocknumber",        &getblocknumber),
@@ -2071,6 +2623,17 @@ pair<string, rpcfn_type> pCallTable[] =
 };
 map<string, rpcfn_type> mapCallTable(pCallTable, pCallTable + sizeof(pCallTable)/sizeof(pCallTable[0]));
 
+// Load generators that stall or slow down the node, only available when
+// started with -benchmark
+pair<string, rpcfn_type> pBenchCallTable[] =
+{
+    make_pair("benchsignatures",       &benchsignatures),
+    make_pair("benchtxheights",        &benchtxheights),
+    make_pair("benchchainwork",        &benchchainwork),
+    make_pair("benchconnections",      &benchconnections),
+    make_pair("benchblockindex",       &benchblockindex),
+};
+
 string pAllowInSafeMode[] =
 {
     "help",
@@ -2438,6 +3001,9 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    if (fBenchmark)
+        mapCallTable.insert(pBenchCallTable, pBenchCallTable + sizeof(pBenchCallTable)/sizeof(pBenchCallTable[0]));
+
     bool fUseSSL = GetBoolArg("-rpcssl");
     asio::ip::address bindAddress = mapArgs.count("-rpcallowip") ? asio::ip::address_v4::any() : asio::ip::address_v4::loopback();
 
@@ -2710,6 +3276,13 @@ int CommandLineRPC(int argc, char *argv[])
         if (strMethod == "name_filter"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
         if (strMethod == "name_filter"            && n > 2) ConvertTo<boost::int64_t>(params[2]);
         if (strMethod == "name_filter"            && n > 3) ConvertTo<boost::int64_t>(params[3]);
+        if (strMethod == "name_expiring"          && n > 0) ConvertTo<boost::int64_t>(params[0]);
+        if (strMethod == "name_expiring"          && n > 1) ConvertTo<boost::int64_t>(params[1]);
+        if (strMethod == "name_expired"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
+        if (strMethod == "name_expired"           && n > 1) ConvertTo<boost::int64_t>(params[1]);
+        if (strMethod == "name_updated"           && n > 1) ConvertTo<boost::int64_t>(params[1]);
+        if (strMethod == "name_updated"           && n > 2) ConvertTo<boost::int64_t>(params[2]);
+        if (strMethod == "name_byvalue"           && n > 1) ConvertTo<boost::int64_t>(params[1]);
         if (strMethod == "sendtoname"             && n > 1) ConvertTo<double>(params[1]);
 
         if (strMethod == "setgenerate"            && n > 0) ConvertTo<bool>(params[0]);
@@ -2739,6 +3312,13 @@ int CommandLineRPC(int argc, char *argv[])
         if (strMethod == "getworkaux"             && n > 2) ConvertTo<boost::int64_t>(params[2]);
         if (strMethod == "listaccounts"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
 	if (strMethod == "getblockbycount"        && n > 0) ConvertTo<boost::int64_t>(params[0]);
+        if (strMethod == "benchsignatures"        && n > 0) ConvertTo<boost::int64_t>(params[0]);
+        if (strMethod == "benchsignatures"        && n > 1) ConvertTo<boost::int64_t>(params[1]);
+        if (strMethod == "benchtxheights"         && n > 0) ConvertTo<boost::int64_t>(params[0]);
+        if (strMethod == "benchchainwork"         && n > 0) ConvertTo<boost::int64_t>(params[0]);
+        if (strMethod == "benchconnections"       && n > 0) ConvertTo<boost::int64_t>(params[0]);
+        if (strMethod == "benchconnections"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
+        if (strMethod == "benchblockindex"        && n > 0) ConvertTo<boost::int64_t>(params[0]);
         if (strMethod == "sendmany"               && n > 1)
         {
             string s = params[1].get_str();
@@ -932,13 +932,123 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+//
+// Valid (sighash, pubkey, signature) triples seen so far, so the signatures
+// of a transaction checked when it entered the memory pool aren't verified
+// again when the transaction shows up in a block.  Only successful checks
+// are remembered, each as one hash of the triple (GetSignatureCacheKey).
+// Used from the signature check threads, so it has its own lock.
+//
+class CSignatureCache
 {
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
+private:
+    set<uint256> setValid;
+    unsigned int nMaxEntries;
+    uint64 nHits;
+    uint64 nMisses;
+    bool fBypass;
+    CCriticalSection cs_sigcache;
+
+public:
+    CSignatureCache()
+    {
+        nMaxEntries = 50000;
+        nHits = 0;
+        nMisses = 0;
+        fBypass = false;
+    }
+
+    bool Get(const uint256& sighash, const valtype& vchSig, const valtype& vchPubKey)
+    {
+        uint256 entry = GetSignatureCacheKey(sighash, vchSig, vchPubKey);
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            if (fBypass)
+                return false;
+            if (setValid.count(entry))
+            {
+                nHits++;
+                return true;
+            }
+            nMisses++;
+        }
         return false;
+    }
+
+    void Set(const uint256& sighash, const valtype& vchSig, const valtype& vchPubKey)
+    {
+        uint256 entry = GetSignatureCacheKey(sighash, vchSig, vchPubKey);
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            if (fBypass)
+                return;
+
+            // Evict a random entry; entries are hashes, so the one after a
+            // random point is as good as any
+            while (setValid.size() >= nMaxEntries && !setValid.empty())
+            {
+                uint256 hashRand;
+                RAND_bytes((unsigned char*)&hashRand, sizeof(hashRand));
+                set<uint256>::iterator it = setValid.lower_bound(hashRand);
+                if (it == setValid.end())
+                    it = setValid.begin();
+                setValid.erase(it);
+            }
+            if (nMaxEntries > 0)
+                setValid.insert(entry);
+        }
+    }
+
+    void SetMaxEntries(unsigned int nMaxEntriesIn)
+    {
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            nMaxEntries = nMaxEntriesIn;
+            while (setValid.size() > nMaxEntries)
+                setValid.erase(setValid.begin());
+        }
+    }
 
+    // Neither look up nor remember signatures, for timing cold verification
+    // without throwing away what the cache holds
+    void SetBypass(bool fBypassIn)
+    {
+        CRITICAL_BLOCK(cs_sigcache)
+            fBypass = fBypassIn;
+    }
+
+    void GetStats(unsigned int& nSize, unsigned int& nMaxSize, uint64& nHitsRet, uint64& nMissesRet)
+    {
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            nSize = setValid.size();
+            nMaxSize = nMaxEntries;
+            nHitsRet = nHits;
+            nMissesRet = nMisses;
+        }
+    }
+};
+
+static CSignatureCache signatureCache;
+
+void SetSignatureCacheSize(unsigned int nMaxEntries)
+{
+    signatureCache.SetMaxEntries(nMaxEntries);
+}
+
+void SetSignatureCacheBypass(bool fBypass)
+{
+    signatureCache.SetBypass(fBypass);
+}
+
+void GetSignatureCacheStats(unsigned int& nSize, unsigned int& nMaxSize, uint64& nHits, uint64& nMisses)
+{
+    signatureCache.GetStats(nSize, nMaxSize, nHits, nMisses);
+}
+
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -948,7 +1058,18 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return false;
     vchSig.pop_back();
 
-    return key.Verify(SignatureHash(scriptCode, txTo, nIn, nHashType), vchSig);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    if (signatureCache.Get(sighash, vchSig, vchPubKey))
+        return true;
+
+    CKey key;
+    if (!key.SetPubKey(vchPubKey))
+        return false;
+    if (!key.Verify(sighash, vchSig))
+        return false;
+
+    signatureCache.Set(sighash, vchSig, vchPubKey);
+    return true;
 }
 
 
@@ -713,11 +713,26 @@ public:
 
 
 
+// Key of a verified (sighash, signature, pubkey) triple in the signature
+// cache.  The parts are serialized with their lengths, otherwise bytes moved
+// from the end of the signature to the front of the pubkey, which a
+// scriptSig can do without changing the sighash, would give the same key.
+inline uint256 GetSignatureCacheKey(const uint256& sighash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& vchPubKey)
+{
+    CDataStream ss(SER_GETHASH);
+    ss << sighash << vchSig << vchPubKey;
+    return Hash(ss.begin(), ss.end());
+}
+
 bool IsStandard(const CScript& scriptPubKey);
 bool IsMine(const CKeyStore& keystore, const CScript& scriptPubKey);
 bool ExtractPubKey(const CScript& scriptPubKey, const CKeyStore* pkeystore, std::vector<unsigned char>& vchPubKeyRet);
 bool ExtractHash160(const CScript& scriptPubKey, uint160& hash160Ret);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, CScript scriptPrereq=CScript());
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType=0);
+void SetSignatureCacheSize(unsigned int nMaxEntries);
+void SetSignatureCacheBypass(bool fBypass);
+void GetSignatureCacheStats(unsigned int& nSize, unsigned int& nMaxSize, uint64& nHits, uint64& nMisses);
 
 #endif
@@ -888,6 +888,7 @@ public:
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
+    void swap(CDataStream& b)                        { vch.swap(b.vch); std::swap(nReadPos, b.nReadPos); }
     iterator insert(iterator it, const char& x=char()) { return vch.insert(it, x); }
     void insert(iterator it, size_type n, const char& x) { vch.insert(it, n, x); }
 
@@ -1268,4 +1269,84 @@ public:
     }
 };
 
+
+
+
+//
+// Read-only stream over a range of memory that is owned by someone else,
+// used to deserialize straight out of a mapped block file
+//
+class CMemoryStream
+{
+protected:
+    const char* pcur;
+    const char* pend;
+    short state;
+    short exceptmask;
+public:
+    int nType;
+    int nVersion;
+
+    CMemoryStream(const char* pbeginIn, const char* pendIn, int nTypeIn=SER_DISK, int nVersionIn=VERSION)
+    {
+        pcur = pbeginIn;
+        pend = pendIn;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+        state = 0;
+        exceptmask = std::ios::badbit | std::ios::failbit;
+    }
+
+    //
+    // Stream subset
+    //
+    void setstate(short bits, const char* psz)
+    {
+        state |= bits;
+        if (state & exceptmask)
+            throw std::ios_base::failure(psz);
+    }
+
+    bool fail() const            { return state & (std::ios::badbit | std::ios::failbit); }
+    bool good() const            { return state == 0; }
+    void clear(short n = 0)      { state = n; }
+    short exceptions()           { return exceptmask; }
+    short exceptions(short mask) { short prev = exceptmask; exceptmask = mask; setstate(0, "CMemoryStream"); return prev; }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+    void ReadVersion()           { *this >> nVersion; }
+    unsigned int size() const    { return pend - pcur; }
+
+    CMemoryStream& read(char* pch, int nSize)
+    {
+        if (nSize > pend - pcur)
+        {
+            setstate(std::ios::failbit, "CMemoryStream::read : end of data");
+            memset(pch, 0, nSize);
+            nSize = pend - pcur;
+        }
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        // Tells the size of the object if serialized to this stream
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CMemoryStream& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
@@ -0,0 +1,26 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../headers.h"
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(key_split)
+{
+    uint256 sighash("0x4ee1b3e8f6c7a6b5c1d6bd3a2f3c9b1f0e2c7d6a5b4c3d2e1f0a9b8c7d6e5f40");
+    std::vector<unsigned char> vchSig(72, 0x30);
+    std::vector<unsigned char> vchPubKey(65, 0x04);
+    vchSig[71] = 0x01;
+
+    // Moving the last byte of the signature to the front of the pubkey
+    // leaves the concatenation unchanged, the key must still differ
+    std::vector<unsigned char> vchSigShifted(vchSig.begin(), vchSig.end() - 1);
+    std::vector<unsigned char> vchPubKeyShifted(1, vchSig.back());
+    vchPubKeyShifted.insert(vchPubKeyShifted.end(), vchPubKey.begin(), vchPubKey.end());
+
+    BOOST_CHECK(GetSignatureCacheKey(sighash, vchSig, vchPubKey) == GetSignatureCacheKey(sighash, vchSig, vchPubKey));
+    BOOST_CHECK(GetSignatureCacheKey(sighash, vchSig, vchPubKey) != GetSignatureCacheKey(sighash, vchSigShifted, vchPubKeyShifted));
+    BOOST_CHECK(GetSignatureCacheKey(sighash, vchSig, vchPubKey) != GetSignatureCacheKey(sighash, vchPubKey, vchSig));
+    BOOST_CHECK(GetSignatureCacheKey(sighash, vchSig, vchPubKey) != GetSignatureCacheKey(sighash + 1, vchSig, vchPubKey));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
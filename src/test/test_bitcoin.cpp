@@ -3,4 +3,5 @@
 
 #include "uint160_tests.cpp"
 #include "uint256_tests.cpp"
+#include "sigcache_tests.cpp"
 
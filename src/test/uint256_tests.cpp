@@ -13,4 +13,51 @@ BOOST_AUTO_TEST_CASE(equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(arithmetic)
+{
+    uint256 a("0x123456789abcdef0123456789abcdef");
+    uint256 b("0xfedcba9876543210fedcba98765");
+    BOOST_CHECK(a * b == uint256("0x121fa00ad77d742247acc91405136ae3a2ef51517895f6c16d6228484b"));
+    BOOST_CHECK(a / b == 0x1249);
+    BOOST_CHECK(a * 12345 == uint256("0x36ddddddddddddaa6dddddddddddddaa37"));
+    BOOST_CHECK((a / b) * b + (a - (a / b) * b) == a);
+    BOOST_CHECK(b / a == 0);
+    BOOST_CHECK(uint256(0).bits() == 0);
+    BOOST_CHECK(uint256(1).bits() == 1);
+    BOOST_CHECK((uint256(1) << 255).bits() == 256);
+    BOOST_CHECK_THROW(a / uint256(0), uint_error);
+}
+
+BOOST_AUTO_TEST_CASE(compact)
+{
+    bool fNegative;
+    bool fOverflow;
+    uint256 num;
+
+    num.SetCompact(0x1d00ffff, &fNegative, &fOverflow);
+    BOOST_CHECK(num == uint256("0x00000000ffff0000000000000000000000000000000000000000000000000000"));
+    BOOST_CHECK(num.GetCompact() == 0x1d00ffff);
+    BOOST_CHECK(!fNegative && !fOverflow);
+
+    num.SetCompact(0x01003456);
+    BOOST_CHECK(num == 0);
+    BOOST_CHECK(num.GetCompact() == 0);
+
+    num.SetCompact(0x02008000);
+    BOOST_CHECK(num == 0x80);
+    BOOST_CHECK(num.GetCompact() == 0x02008000);
+
+    num.SetCompact(0x04923456, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0x12345600);
+    BOOST_CHECK(fNegative);
+    BOOST_CHECK(num.GetCompact(true) == 0x04923456);
+
+    num.SetCompact(0xff123456, &fNegative, &fOverflow);
+    BOOST_CHECK(fOverflow);
+
+    // Work for the genesis difficulty
+    num.SetCompact(0x1d00ffff);
+    BOOST_CHECK((~num / (num + 1)) + 1 == uint256("0x100010001"));
+}
+
 BOOST_AUTO_TEST_SUITE_END()